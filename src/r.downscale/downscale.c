@@ -21,18 +21,17 @@ int downscale (char *agg_stats,
 			   char *prior_raster, 
 			   char *vdom_raster,
 			   char *oraster, 
-			   char *oformat)
+			   char *oformat,
+			   int prob_double)
 {
 	
 	int *agg_sum;				// Aggregated statistics.
 	int minindex, maxindex;		// Maximum and minimum indices for aggregated statistics.
-	int i;
 	int rasterX, rasterY;		// The size of the raster files.
 	int *agg_data;				// The content of the aggregate raster.
-	double *prob_data;			// The content of the probability raster.
-	int *prior_data;			// The content of the prior raster.
-	int *vdom, *vdom_ptr;		// The content of the validity domain raster.
-	int *out_data;				// Output data matrix.
+	void *prob_data;			// The content of the probability raster (float or double).
+	unsigned char *vdom;		// The validity domain bitmask (NULL = whole region).
+	int *out_data;				// Output data matrix (initialised with the prior).
 	
 	GDALDriverH odriver;		// The output GDAL driver.
 	GDALDatasetH idataset;		// An input dataset.
@@ -54,6 +53,7 @@ int downscale (char *agg_stats,
 	printf("   Validity domain raster file: %s\n", vdom_raster);
 	printf("   Output raster file: %s\n", oraster);
 	printf("   Output raster format: %s\n", oformat);
+	printf("   Probability precision: %s\n", prob_double ? "double" : "float");
 	printf("\n");
 
 	
@@ -81,17 +81,27 @@ int downscale (char *agg_stats,
 	
 	
 	// Read the probability raster.
-	if (readProbabilityRaster(prob_raster, &prob_data) != 0)
+	if (readProbabilityRaster(prob_raster, &prob_data, prob_double, rasterX, rasterY) != 0)
 	{
 		fprintf(stderr, "Error while reading probability raster file.\n");
 		return 1;
 	}
 	
 	
-	// Read the prior raster if there is one.
+	// Allocate the memory for the output raster.
+	out_data = calloc((size_t)rasterX * rasterY, sizeof(int));
+	if (out_data == NULL)
+	{
+		fprintf(stderr, "Error. Not enough memory for the output raster.\n");
+		return 1;
+	}
+	
+	
+	// Read the prior raster if there is one. The prior is read directly
+	// into the output array, as the posterior starts from the prior.
 	if (prior_raster != NULL)
 	{
-		if (readPriorRaster(prior_raster, &prior_data) != 0)
+		if (readPriorRaster(prior_raster, out_data, rasterX, rasterY) != 0)
 		{
 			fprintf(stderr, "Error while reading prior raster file.\n");
 			return 1;
@@ -100,38 +110,22 @@ int downscale (char *agg_stats,
 	
 	
 	// Read the validity domain raster if there is one.
-	// If we don't have a validity domain raster, just create the array
-	// and initialize with 1 (validity domain = whole region)
+	// If we don't have a validity domain raster, the bitmask stays NULL
+	// (validity domain = whole region).
+	vdom = NULL;
 	if (vdom_raster != NULL)
 	{
-		if (readValidityDomainRaster(vdom_raster, &vdom) != 0)
+		if (readValidityDomainRaster(vdom_raster, &vdom, rasterX, rasterY) != 0)
 		{
 			fprintf(stderr, "Error while reading validity domain raster file.\n");
 			return 1;
 		}
 	}
-	else
-	{
-		vdom = malloc(rasterX * rasterY * sizeof(int));
-		vdom_ptr = vdom;
-		for (i = 0; i < (rasterX * rasterY); i++)
-		{
-			*vdom_ptr = 1;
-			vdom_ptr++;
-		}
-	}
-	
-	
-	
-	
-	
-	// Allocate the memory for the output raster.
-	out_data = calloc(rasterX*rasterY, sizeof(int));
 	
 	
 	
 	// Downscale data.
-	downscaleData(agg_sum, minindex, maxindex, agg_data, prob_data, prior_data, vdom, out_data, rasterX, rasterY);
+	downscaleData(agg_sum, minindex, maxindex, agg_data, prob_data, prob_double, vdom, out_data, rasterX, rasterY);
 	
 	
 	
@@ -145,7 +139,6 @@ int downscale (char *agg_stats,
 		if (odriver == NULL)
 		{
 			fprintf(stderr, "Error. Unable to get HFA driver.\n");
-			GDALClose(odataset);
 			return 1;
 		}
 	}
@@ -172,10 +165,9 @@ int downscale (char *agg_stats,
 	free(agg_sum);
 	free(agg_data);
 	free(prob_data);
-	if (prior_data != NULL)
-		free(prior_data);
 	free(out_data);
-	free(vdom);
+	if (vdom != NULL)
+		free(vdom);
 	
 	
 	return 0;
@@ -395,7 +387,7 @@ int readAggregateRaster(char *agg_raster, int** agg_data, int *rasterX, int *ras
 	iband = GDALGetRasterBand(idataset, 1);
 	
 	// Fetch the input raster band content.
-	agg_data_size = *rasterX * *rasterY * sizeof(int);
+	agg_data_size = (size_t)*rasterX * *rasterY * sizeof(int);
 	*agg_data = (int*) malloc(agg_data_size);
 	if (*agg_data == NULL)
 	{
@@ -417,12 +409,14 @@ int readAggregateRaster(char *agg_raster, int** agg_data, int *rasterX, int *ras
 
 
 
-int readProbabilityRaster(char *prob_raster, double** prob_data)
+int readProbabilityRaster(char *prob_raster, void** prob_data, int prob_double,
+						  int rasterX, int rasterY)
 {
 	
 	GDALDatasetH idataset;
 	GDALRasterBandH iband;				// The input raster band.
 	int x, y;
+	size_t cell_size;
 	
 	// Open the input raster file.
 	idataset = GDALOpen(prob_raster, GA_ReadOnly);
@@ -432,22 +426,38 @@ int readProbabilityRaster(char *prob_raster, double** prob_data)
 		return 1;
 	}
 	
-	// Get the size of the input raster.
+	// Get the size of the input raster. It must match the aggregate raster,
+	// as the probabilities are indexed with the aggregate cell offsets.
 	x = GDALGetRasterXSize(idataset);
 	y = GDALGetRasterYSize(idataset);
+	if (x != rasterX || y != rasterY)
+	{
+		GDALClose(idataset);
+		fprintf(stderr, "Error. Probability raster size (%i x %i) differs from aggregate raster size (%i x %i).\n", x, y, rasterX, rasterY);
+		return 1;
+	}
 	
 	// Get the input raster band.
 	iband = GDALGetRasterBand(idataset, 1);
 	
 	// Fetch the input raster band content.
-	*prob_data = (double*) malloc(x * y * sizeof(double));
+	cell_size = prob_double ? sizeof(double) : sizeof(float);
+	*prob_data = malloc((size_t)x * y * cell_size);
 	if (*prob_data == NULL)
 	{
 		GDALClose(idataset);
 		fprintf(stderr, "Error. Not enough memory to read probability raster.\n");
 		return 1;
 	}
-	GDALRasterIO(iband, GF_Read, 0, 0, x, y, *prob_data, x, y, GDT_Float64, 0, 0);
+	if (GDALRasterIO(iband, GF_Read, 0, 0, x, y, *prob_data, x, y, 
+					 prob_double ? GDT_Float64 : GDT_Float32, 0, 0) != CE_None)
+	{
+		free(*prob_data);
+		*prob_data = NULL;
+		GDALClose(idataset);
+		fprintf(stderr, "Error. Unable to read probability raster '%s'\n", prob_raster);
+		return 1;
+	}
 	
 	GDALClose(idataset);
 	
@@ -459,7 +469,7 @@ int readProbabilityRaster(char *prob_raster, double** prob_data)
 
 
 
-int readPriorRaster(char *prior_raster, int** prior_data)
+int readPriorRaster(char *prior_raster, int* out_data, int rasterX, int rasterY)
 {
 	
 	GDALDatasetH idataset;
@@ -474,22 +484,27 @@ int readPriorRaster(char *prior_raster, int** prior_data)
 		return 1;
 	}
 	
-	// Get the size of the input raster.
+	// Get the size of the input raster. It must match the aggregate raster,
+	// as the prior is read directly into the output array.
 	x = GDALGetRasterXSize(idataset);
 	y = GDALGetRasterYSize(idataset);
+	if (x != rasterX || y != rasterY)
+	{
+		GDALClose(idataset);
+		fprintf(stderr, "Error. Prior raster size (%i x %i) differs from aggregate raster size (%i x %i).\n", x, y, rasterX, rasterY);
+		return 1;
+	}
 	
 	// Get the input raster band.
 	iband = GDALGetRasterBand(idataset, 1);
 	
 	// Fetch the input raster band content.
-	*prior_data = (int*) malloc(x * y * sizeof(int));
-	if (*prior_data == NULL)
+	if (GDALRasterIO(iband, GF_Read, 0, 0, x, y, out_data, x, y, GDT_Int32, 0, 0) != CE_None)
 	{
 		GDALClose(idataset);
-		fprintf(stderr, "Error. Not enough memory to read prior raster.\n");
+		fprintf(stderr, "Error. Unable to read prior raster '%s'\n", prior_raster);
 		return 1;
 	}
-	GDALRasterIO(iband, GF_Read, 0, 0, x, y, *prior_data, x, y, GDT_Int32, 0, 0);
 	
 	GDALClose(idataset);
 	
@@ -502,11 +517,13 @@ int readPriorRaster(char *prior_raster, int** prior_data)
 
 
 
-int readValidityDomainRaster(char *vdom_raster, int** vdom)
+int readValidityDomainRaster(char *vdom_raster, unsigned char** vdom, int rasterX, int rasterY)
 {
 	GDALDatasetH idataset;
 	GDALRasterBandH iband;				// The input raster band.
-	int x, y;
+	int x, y, i, j;
+	size_t k;
+	unsigned char *row;					// One row of the raster as bytes.
 	
 	// Open the input raster file.
 	idataset = GDALOpen(vdom_raster, GA_ReadOnly);
@@ -516,23 +533,52 @@ int readValidityDomainRaster(char *vdom_raster, int** vdom)
 		return 1;
 	}
 	
-	// Get the size of the input raster.
+	// Get the size of the input raster. It must match the aggregate raster,
+	// as the bitmask is indexed with the cells of the aggregate raster.
 	x = GDALGetRasterXSize(idataset);
 	y = GDALGetRasterYSize(idataset);
+	if (x != rasterX || y != rasterY)
+	{
+		GDALClose(idataset);
+		fprintf(stderr, "Error. Validity domain raster size (%i x %i) differs from aggregate raster size (%i x %i).\n", x, y, rasterX, rasterY);
+		return 1;
+	}
 	
 	// Get the input raster band.
 	iband = GDALGetRasterBand(idataset, 1);
 	
-	// Fetch the input raster band content.
-	*vdom = (int*) malloc(x * y * sizeof(int));
-	if (*vdom == NULL)
+	// Allocate the bitmask, one bit per cell.
+	*vdom = calloc(((size_t)x * y + 7) / 8, 1);
+	row = malloc(x);
+	if (*vdom == NULL || row == NULL)
 	{
 		GDALClose(idataset);
 		fprintf(stderr, "Error. Not enough memory to read validity domain raster.\n");
 		return 1;
 	}
-	GDALRasterIO(iband, GF_Read, 0, 0, x, y, *vdom, x, y, GDT_Int32, 0, 0);
 	
+	// Fetch the input raster band content row by row, and set the bits.
+	k = 0;
+	for (j = 0; j < y; j++)
+	{
+		if (GDALRasterIO(iband, GF_Read, 0, j, x, 1, row, x, 1, GDT_Byte, 0, 0) != CE_None)
+		{
+			free(row);
+			free(*vdom);
+			*vdom = NULL;
+			GDALClose(idataset);
+			fprintf(stderr, "Error. Unable to read validity domain raster '%s'\n", vdom_raster);
+			return 1;
+		}
+		for (i = 0; i < x; i++)
+		{
+			if (row[i] != 0)
+				(*vdom)[k >> 3] |= (1 << (k & 7));
+			k++;
+		}
+	}
+	
+	free(row);
 	GDALClose(idataset);
 	
 	return 0;
@@ -547,18 +593,17 @@ int readValidityDomainRaster(char *vdom_raster, int** vdom)
 
 
 void downscaleData(int *agg_sum, int minindex, int maxindex, 
-				   int *agg_data, double *prob_data, int *prior_data, int *vdom, int *out_data, 
+				   int *agg_data, void *prob_data, int prob_double, 
+				   unsigned char *vdom, int *out_data, 
 				   int rasterX, int rasterY)
 {
 
 	double *prob_agg;		// Aggregated probability data.
 	int *prior_agg;			// Aggregated prior data.
-	int i, index;
-	int *agg_data_ptr;
-	double *prob_data_ptr;
-	int *prior_data_ptr;
-	int *vdom_ptr;
-	int *out_data_ptr;
+	FeatureBlock *blocks;	// Bounding box of each feature.
+	FeatureBlock *b;
+	int i, j, index;
+	size_t k;
 	int diff_to_distribute;
 	
 	int prct, prct_old;				// Percentage done.
@@ -567,62 +612,50 @@ void downscaleData(int *agg_sum, int minindex, int maxindex,
 	
 	
 	
-	// Compute the sums of the probability and prior data for each aggregated feature.
+	// Compute the sums of the probability and prior data for each aggregated 
+	// feature, as well as the bounding box of each feature. The prior is
+	// already in the output array.
 	
 	prob_agg = calloc(maxindex - minindex + 1, sizeof(double));
 	prior_agg = calloc(maxindex - minindex + 1, sizeof(int));
+	blocks = malloc((maxindex - minindex + 1) * sizeof(FeatureBlock));
 	
-	agg_data_ptr = agg_data;
-	prob_data_ptr = prob_data;
-	vdom_ptr = vdom;
-	for (i = 0; i < (rasterX*rasterY); i++)
+	for (i = 0; i <= (maxindex - minindex); i++)
 	{
-		if (*agg_data_ptr >= minindex && *agg_data_ptr <= maxindex)
-		{
-			index = *agg_data_ptr - minindex;
-			prob_agg[index] += *prob_data_ptr * (double)*vdom_ptr;
-		}
-		agg_data_ptr++;
-		prob_data_ptr++;
-		vdom_ptr++;
+		blocks[i].x0 = rasterX;
+		blocks[i].y0 = rasterY;
+		blocks[i].x1 = -1;
+		blocks[i].y1 = -1;
 	}
 	
-
-	
-	if (prior_data != NULL)
+	k = 0;
+	for (j = 0; j < rasterY; j++)
 	{
-		agg_data_ptr = agg_data;
-		prior_data_ptr = prior_data;
-		vdom_ptr = vdom;
-		for (i = 0; i < (rasterX*rasterY); i++)
+		for (i = 0; i < rasterX; i++)
 		{
-			if (*agg_data_ptr >= minindex && *agg_data_ptr <= maxindex)
+			if (agg_data[k] >= minindex && agg_data[k] <= maxindex)
 			{
-				index = *agg_data_ptr - minindex;
-				prior_agg[index] += *prior_data_ptr * *vdom_ptr;
+				index = agg_data[k] - minindex;
+				
+				b = &blocks[index];
+				if (i < b->x0) b->x0 = i;
+				if (i > b->x1) b->x1 = i;
+				if (j < b->y0) b->y0 = j;
+				if (j > b->y1) b->y1 = j;
+				
+				if (VDOM_VALID(vdom, k))
+				{
+					prob_agg[index] += PROB_VALUE(prob_data, prob_double, k);
+					prior_agg[index] += out_data[k];
+				}
 			}
-			agg_data_ptr++;
-			prior_data_ptr++;
-			vdom_ptr++;
+			k++;
 		}
 	}
 	
 	
 	
 	
-	// Copy prior distribution to output distribution, if necessary.
-	prior_data_ptr = prior_data;
-	out_data_ptr = out_data;
-	for (i = 0; i < (rasterX*rasterY); i++)
-	{
-		*out_data_ptr = *prior_data_ptr;
-		out_data_ptr++;
-		prior_data_ptr++;
-	}
-	
-	
-	
-	
 	prct = 0;
 	prct_old = 0;
 	
@@ -641,10 +674,10 @@ void downscaleData(int *agg_sum, int minindex, int maxindex,
 			printf("Treating feature ID %i. Old value: %i. New value: %i. Difference: %i\n", i, prior_agg[index], agg_sum[index], diff_to_distribute);
 			estimateDistribution(i, agg_data,
 								 diff_to_distribute, 
-								 prob_data, prob_agg[index], 
+								 prob_data, prob_double, prob_agg[index], 
 								 vdom,
 								 out_data,
-								 rasterX, rasterY);
+								 rasterX, &blocks[index]);
 		}
 		
 		
@@ -661,8 +694,8 @@ void downscaleData(int *agg_sum, int minindex, int maxindex,
 	
 	// Free the allocated memory.
 	free(prob_agg);
-	if (prior_data != NULL)
-		free(prior_agg);
+	free(prior_agg);
+	free(blocks);
 	
 	
 }
@@ -674,15 +707,70 @@ void downscaleData(int *agg_sum, int minindex, int maxindex,
 
 void estimateDistribution(int feature_id, int *feature_dist,
 						  int diff_to_distribute, 
-						  double *prob_dist, double prob_sum, 
-						  int *vdom,
+						  void *prob_dist, int prob_double, double prob_sum, 
+						  unsigned char *vdom,
 						  int *out_dist,
-						  int size_x, int size_y)
+						  int size_x, FeatureBlock *block)
 {
 	
 	int still_to_distribute;			// Sum left to distribute;
 	double rand_value;
 	int i, j;
+	size_t k, ncells, pos;
+	size_t *cells;						// Raster index of the feature cells.
+	double *cum_prob;					// Cumulated probability of the feature cells.
+	double current_sum;
+	
+	
+	if (block->x1 < block->x0)
+	{
+		fprintf(stderr, "Warning. Feature ID %i has no pixel in the aggregate raster.\n", feature_id);
+		return;
+	}
+	
+	
+	// Count the cells of the feature inside its bounding box.
+	ncells = 0;
+	for (j = block->y0; j <= block->y1; j++)
+	{
+		k = (size_t)j * size_x + block->x0;
+		for (i = block->x0; i <= block->x1; i++, k++)
+		{
+			if (feature_dist[k] == feature_id)
+				ncells++;
+		}
+	}
+	
+	cells = malloc(ncells * sizeof(size_t));
+	cum_prob = malloc(ncells * sizeof(double));
+	if (cells == NULL || cum_prob == NULL)
+	{
+		fprintf(stderr, "Error. Not enough memory for feature ID %i.\n", feature_id);
+		if (cells != NULL) free(cells);
+		if (cum_prob != NULL) free(cum_prob);
+		return;
+	}
+	
+	
+	// Compute the cumulated probability once for the feature, in raster order.
+	current_sum = 0.0;
+	pos = 0;
+	for (j = block->y0; j <= block->y1; j++)
+	{
+		k = (size_t)j * size_x + block->x0;
+		for (i = block->x0; i <= block->x1; i++, k++)
+		{
+			if (feature_dist[k] == feature_id)
+			{
+				if (VDOM_VALID(vdom, k))
+					current_sum += PROB_VALUE(prob_dist, prob_double, k);
+				cells[pos] = k;
+				cum_prob[pos] = current_sum;
+				pos++;
+			}
+		}
+	}
+	
 	
 	// Distribute the values randomly until there is nothing left to distribute.
 	still_to_distribute = diff_to_distribute;
@@ -692,79 +780,49 @@ void estimateDistribution(int feature_id, int *feature_dist,
 		// Get a random value between 0 and prob_sum.
 		rand_value = prob_sum * ((double)random() / (double)RAND_MAX);
 		
-		findIndexForCumulatedValue(rand_value, prob_dist, vdom, feature_id, feature_dist, size_x, size_y, &i, &j);
+		pos = findIndexForCumulatedValue(rand_value, cum_prob, ncells);
+		k = cells[pos];
 		
-		if (i >= 0 && i < size_x && j >= 0 && j < size_y)
+		if (still_to_distribute < 0)
 		{
-			if (still_to_distribute < 0)
-			{
-				out_dist[i + (j*size_x)]--;
-				still_to_distribute++;
-			}
-			else
-			{
-				out_dist[i + (j*size_x)]++;
-				still_to_distribute--;
-			}
+			out_dist[k]--;
+			still_to_distribute++;
+		}
+		else
+		{
+			out_dist[k]++;
+			still_to_distribute--;
 		}
 		
 	}
 	
+	free(cells);
+	free(cum_prob);
 	
 }
 
 
 
-void findIndexForCumulatedValue(double cum_val, double *prob_dist, int *vdom,
-								int feature_id, int *feature_dist, 
-								int size_x, int size_y, 
-								int *x, int *y)
+size_t findIndexForCumulatedValue(double cum_val, double *cum_prob, size_t ncells)
 {
 	
-	double current_sum;
-	int i, j, last_i, last_j;
-	double *prob_dist_ptr;
-	int *feature_dist_ptr;
-	int *vdom_ptr;
-	
-	
-	current_sum = 0.0f;
-	prob_dist_ptr = prob_dist;
-	feature_dist_ptr = feature_dist;
-	vdom_ptr = vdom;
+	size_t lo, hi, mid;
 	
-	for (j = 0; j < size_y; j++)
+	// Find the first position with cum_prob > cum_val.
+	lo = 0;
+	hi = ncells;
+	while (lo < hi)
 	{
-		for (i = 0; i < size_x; i++)
-		{
-			if (*feature_dist_ptr == feature_id)
-			{
-				current_sum += *prob_dist_ptr * *vdom_ptr;
-				last_i = i;
-				last_j = j;
-				
-				if (current_sum > cum_val)
-				{
-					*x = i;
-					*y = j;
-					return;
-				}
-			}
-			
-			feature_dist_ptr++;
-			prob_dist_ptr++;
-			vdom_ptr++;
-		}
+		mid = lo + (hi - lo) / 2;
+		if (cum_prob[mid] > cum_val)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
-		   
 	
-	*x = last_i;
-	*y = last_j;
+	// If there is none, take the last cell of the feature.
+	if (lo >= ncells)
+		lo = ncells - 1;
 	
-	return;	   
+	return lo;
 }
-
-
-
-
-
@@ -8,15 +8,51 @@
  */
 
 
+#include <stddef.h>
 
 
-int downscale (char *agg_stats, 
-			   char *agg_raster, 
-			   char *prob_raster, 
-			   char *prior_raster, 
+
+/*
+ * Value of the probability raster at cell k. The probability raster is stored
+ * in single precision (float) unless prob_double is set, in which case it is
+ * stored in double precision.
+ */
+#define PROB_VALUE(prob, prob_double, k) \
+	((prob_double) ? ((double*)(prob))[k] : (double)((float*)(prob))[k])
+
+
+/*
+ * Tests whether cell k lies inside the validity domain. The validity domain is
+ * stored as a bitmask with one bit per cell. A NULL mask means that the whole
+ * region is valid.
+ */
+#define VDOM_VALID(vdom, k) \
+	((vdom) == NULL || ((vdom)[(k) >> 3] & (1 << ((k) & 7))))
+
+
+
+/*
+ * Bounding box of a feature in the aggregate raster (in pixels, inclusive).
+ * A feature without any pixel has x0 > x1.
+ */
+typedef struct {
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+} FeatureBlock;
+
+
+
+
+int downscale (char *agg_stats,
+			   char *agg_raster,
+			   char *prob_raster,
+			   char *prior_raster,
 			   char *vdom_raster,
-			   char *oraster, 
-			   char *oformat);
+			   char *oraster,
+			   char *oformat,
+			   int prob_double);
 
 
 
@@ -42,17 +78,40 @@ int readAggregatedStats (char* agg_stats, int** agg_sum, int *minindex, int *max
 int readAggregateRaster(char *agg_raster, int** agg_data, int *rasterX, int *rasterY);
 
 
-int readProbabilityRaster(char *prob_raster, double** prob_data);
+/**
+ * Reads the probability raster, as float array or as double array if
+ * prob_double is set. The probability raster must have the same size
+ * as the aggregate raster (rasterX * rasterY cells).
+ */
+int readProbabilityRaster(char *prob_raster, void** prob_data, int prob_double,
+						  int rasterX, int rasterY);
+
 
-int readPriorRaster(char *prior_raster, int** prior_data);
+/**
+ * Reads the prior raster directly into the output array, which must be
+ * allocated by the caller with rasterX * rasterY cells. The prior raster
+ * must have the same size.
+ */
+int readPriorRaster(char *prior_raster, int* out_data, int rasterX, int rasterY);
 
-int readValidityDomainRaster(char *vdom_raster, int** vdom);
 
+/**
+ * Reads the validity domain raster into a bitmask with one bit per cell.
+ * The bitmask is allocated by this function. The validity domain raster
+ * must have the size of the aggregate raster (rasterX * rasterY).
+ */
+int readValidityDomainRaster(char *vdom_raster, unsigned char** vdom, int rasterX, int rasterY);
 
 
 
-void downscaleData(int *agg_sum, int minindex, int maxindex, 
-				   int *agg_data, double *prob_data, int *prior_data, int *vdom, int *out_data, 
+
+/**
+ * Distributes the aggregated statistics. out_data must contain the prior
+ * distribution (or zeros) when calling this function.
+ */
+void downscaleData(int *agg_sum, int minindex, int maxindex,
+				   int *agg_data, void *prob_data, int prob_double,
+				   unsigned char *vdom, int *out_data,
 				   int rasterX, int rasterY);
 
 
@@ -60,19 +119,23 @@ void downscaleData(int *agg_sum, int minindex, int maxindex,
 
 /**
  * Estimates the posterior distribution for a given feature.
+ * Only the pixels inside the bounding box of the feature are visited.
  */
 void estimateDistribution(int feature_id, int *feature_dist,
-						  int diff_to_distribute, 
-						  double *prob_dist, double prob_sum, 
-						  int *vdom,
+						  int diff_to_distribute,
+						  void *prob_dist, int prob_double, double prob_sum,
+						  unsigned char *vdom,
 						  int *out_dist,
-						  int size_x, int size_y);
+						  int size_x, FeatureBlock *block);
+
 
 
 
+/**
+ * Returns the position of the first cumulated probability larger than
+ * cum_val (binary search). Returns the last position if there is none.
+ */
+size_t findIndexForCumulatedValue(double cum_val, double *cum_prob, size_t ncells);
+
 
-void findIndexForCumulatedValue(double cum_val, double *prob_dist, int *vdom,
-								int feature_id, int *feature_dist, 
-								int size_x, int size_y, 
-								int *i, int *j);
 
@@ -16,7 +16,7 @@ static char *usage[] = {
 "                 \n\n",
 "SYNOPSIS\n",
 "   r.downscale \n",
-"      [-h] [-f format] [-p prior_raster] [-v validity_domain_raster]\n",
+"      [-h] [-d] [-f format] [-p prior_raster] [-v validity_domain_raster]\n",
 "      aggregated_stats.txt aggregate_raster probability_raster output_raster\n\n",
 "DESCRIPTION\n",
 "   Note that all raster files must cover the same region and have the same \n",
@@ -24,6 +24,9 @@ static char *usage[] = {
 "   The following options are available:\n\n",
 "   -h\n",
 "      Shows this information and quits.\n\n",
+"   -d\n",
+"      Keeps the probability raster in double precision. By default, it is\n",
+"      read in single precision, which halves the memory needed for it.\n\n",
 "   -p prior_raster\n",
 "      Raster which contains the prior distribution. This must be an integer\n",
 "      raster dataset.\n\n",
@@ -96,6 +99,7 @@ int main (int argc, const char * argv[])
 	char *oraster;					// Output raster.
 	char *oformat;					// Output raster format.
 	char defaultFormat[] = "HFA";	// Default format is Imagine
+	int prob_double;				// Probability raster in double precision?
 	int ok;
 	
 	extern int optind;
@@ -111,10 +115,11 @@ int main (int argc, const char * argv[])
 	prior_raster = NULL;
 	vdom_raster = NULL;
 	oraster = NULL;
+	prob_double = 0;
 	
 	
 	// Process command line
-	while ((c = getopt(argc, (char**)argv, "hf:p:v:")) != -1) {
+	while ((c = getopt(argc, (char**)argv, "hdf:p:v:")) != -1) {
 		switch (c) {
 				
 			case 'h':
@@ -125,6 +130,10 @@ int main (int argc, const char * argv[])
 				}
 				return 0;
 				
+			case 'd':
+				prob_double = 1;
+				break;
+				
 			case 'p':
 				prior_raster = optarg;
 				break;
@@ -175,7 +184,7 @@ int main (int argc, const char * argv[])
 	
 	
 	
-	ok = downscale(agg_stats, agg_raster, prob_raster, prior_raster, vdom_raster, oraster, oformat);
+	ok = downscale(agg_stats, agg_raster, prob_raster, prior_raster, vdom_raster, oraster, oformat, prob_double);
 
     return ok;
 }
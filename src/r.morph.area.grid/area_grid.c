@@ -8,6 +8,8 @@
  */
 
 
+#include <math.h>
+
 #include <GDAL/GDAL.h>
 
 #include "area_grid.h"
@@ -16,17 +18,145 @@
 
 
 
+/*
+ * Mean area of the cells of the morph grid, i.e. the area enclosed by the
+ * border of the grid divided by the number of cells.
+ */
+static double grid_mean_area (morph *mgrid) {
+	
+	double	area, x0, y0, x1, y1;
+	int		i, j, xsize, ysize;
+	
+	xsize = mgrid->xsize;
+	ysize = mgrid->ysize;
+	
+	// Walk along the border of the grid (shoelace formula).
+	area = 0.0;
+	x0 = MORPH_X(mgrid, 0, 0);
+	y0 = MORPH_Y(mgrid, 0, 0);
+	for (i = 1; i <= xsize; i++) {
+		x1 = MORPH_X(mgrid, i, 0);		y1 = MORPH_Y(mgrid, i, 0);
+		area += x0*y1 - x1*y0;			x0 = x1;	y0 = y1;
+	}
+	for (j = 1; j <= ysize; j++) {
+		x1 = MORPH_X(mgrid, xsize, j);	y1 = MORPH_Y(mgrid, xsize, j);
+		area += x0*y1 - x1*y0;			x0 = x1;	y0 = y1;
+	}
+	for (i = xsize-1; i >= 0; i--) {
+		x1 = MORPH_X(mgrid, i, ysize);	y1 = MORPH_Y(mgrid, i, ysize);
+		area += x0*y1 - x1*y0;			x0 = x1;	y0 = y1;
+	}
+	for (j = ysize-1; j >= 0; j--) {
+		x1 = MORPH_X(mgrid, 0, j);		y1 = MORPH_Y(mgrid, 0, j);
+		area += x0*y1 - x1*y0;			x0 = x1;	y0 = y1;
+	}
+	
+	return 0.5 * ABS(area) / ((double)xsize * ysize);
+}
+
+
+
+
+/*
+ * Computes the output values of the cells j0 to j0+nrows-1 of column i.
+ * The values of band b are written to out[b*xsize*nrows + i*nrows + j-j0],
+ * i.e. every band is stored column by column, as the grid. The loops run
+ * over consecutive memory and have no branches, so that the compiler can
+ * vectorise them.
+ */
+static void area_column (morph *mgrid, int i, int j0, int nrows, int nbands, 
+						 double mean_area, double *out) {
+	
+	double	*gx0, *gy0, *gx1, *gy1;
+	double	*area, *ratio, *angle, *scale;
+	double	ax, ay, bx, by, cx, cy, dx, dy;
+	double	s1, s2, norm;
+	double	xu, xv, yu, yv, e, f, g, h, q, r, smax, smin;
+	int		j;
+	
+	gx0 = &MORPH_X(mgrid, i, j0);
+	gy0 = &MORPH_Y(mgrid, i, j0);
+	gx1 = &MORPH_X(mgrid, i+1, j0);
+	gy1 = &MORPH_Y(mgrid, i+1, j0);
+	
+	area = out + (size_t)i*nrows;
+	
+	// The area of the cell is the sum of the triangles on both sides
+	// of the diagonal.
+	for (j = 0; j < nrows; j++) {
+		ax = gx0[j];
+		ay = gy0[j];
+		bx = gx1[j];
+		by = gy1[j];
+		cx = gx0[j+1];
+		cy = gy0[j+1];
+		dx = gx1[j+1];
+		dy = gy1[j+1];
+		
+		s1 = 0.5 * ABS((dx-ax)*(by-ay) - (dy-ay)*(bx-ax));
+		s2 = 0.5 * ABS((dx-ax)*(cy-ay) - (dy-ay)*(cx-ax));
+		
+		area[j] = s1 + s2;
+	}
+	
+	if (nbands == 1) {
+		return;
+	}
+	
+	ratio = area + (size_t)mgrid->xsize*nrows;
+	angle = ratio + (size_t)mgrid->xsize*nrows;
+	scale = angle + (size_t)mgrid->xsize*nrows;
+	norm = 1.0 / sqrt(mean_area);
+	
+	// The distortion is computed from the Jacobian of the bilinear mapping
+	// of the cell at its centre, relative to the mean cell size. Its
+	// singular values are the largest and smallest scale factors of the
+	// Tissot indicatrix.
+	for (j = 0; j < nrows; j++) {
+		ax = gx0[j];
+		ay = gy0[j];
+		bx = gx1[j];
+		by = gy1[j];
+		cx = gx0[j+1];
+		cy = gy0[j+1];
+		dx = gx1[j+1];
+		dy = gy1[j+1];
+		
+		xu = 0.5 * norm * ((bx-ax) + (dx-cx));
+		xv = 0.5 * norm * ((cx-ax) + (dx-bx));
+		yu = 0.5 * norm * ((by-ay) + (dy-cy));
+		yv = 0.5 * norm * ((cy-ay) + (dy-by));
+		
+		e = 0.5 * (xu + yv);
+		f = 0.5 * (xu - yv);
+		g = 0.5 * (yu + xv);
+		h = 0.5 * (yu - xv);
+		q = sqrt(e*e + h*h);
+		r = sqrt(f*f + g*g);
+		smax = q + r;
+		smin = ABS(q - r);
+		
+		ratio[j] = area[j] / mean_area;
+		angle[j] = 2.0 * asin((smax - smin) / (smax + smin + 1e-300)) * 180.0 / M_PI;
+		scale[j] = smax;
+	}
+}
+
+
+
 
-int area_grid (char *infile, char *outfile, char *format) {
+int area_grid (char *infile, char *outfile, char *format, int distortion) {
 
 	morph				*mgrid;
 	GDALDriverH			out_driver;
 	GDALDatasetH		out_ds;
 	GDALRasterBandH		out_band;
-	double				*rast;
-	double				ax, ay, bx, by, cx, cy, dx, dy;
-	double				s1, s2;
-	int					i, j, idx;
+	double				*buf[2];		// Block being computed and block being written.
+	double				*cur, *prev;
+	double				mean_area;
+	int					i, b, t, nbands, block_rows, nblocks, nrows, blockx, blocky;
+	int					write_errors;
+	static char			*band_names[] = {"area", "area ratio", "angular distortion", "local scale"};
 	
 	
 	GDALAllRegister();
@@ -39,59 +169,95 @@ int area_grid (char *infile, char *outfile, char *format) {
 	}
 	
 	// Create a new raster file
+	nbands = distortion ? 4 : 1;
 	out_driver = GDALGetDriverByName(format);
 	if (out_driver == NULL) {
 		fprintf(stderr, "Warning. Unable to find driver for GDAL format '%s'. Using HFA format instead.\n", format);
 		out_driver = GDALGetDriverByName("HFA");
 	}
-	out_ds = GDALCreate(out_driver, outfile, mgrid->xsize, mgrid->ysize, 1, GDT_Float64, NULL);
+	out_ds = GDALCreate(out_driver, outfile, mgrid->xsize, mgrid->ysize, nbands, GDT_Float64, NULL);
+	if (out_ds == NULL) {
+		fprintf(stderr, "Error. Unable to create output raster '%s'.\n", outfile);
+		exit(1);
+	}
 	GDALSetGeoTransform(out_ds, mgrid->georef);
+	for (b = 0; b < nbands; b++) {
+		GDALSetDescription(GDALGetRasterBand(out_ds, b+1), band_names[b]);
+	}
 	
-	// Allocate the memory for holding the raster data.
-	rast = calloc(mgrid->xsize * mgrid->ysize, sizeof(double));
-	if (rast == NULL) {
-		fprintf(stderr, "Error. Not enough memory.\n");
-		exit(1);
+	// The raster is computed and written in blocks of rows, which are
+	// a multiple of the block height of the output format.
+	GDALGetBlockSize(GDALGetRasterBand(out_ds, 1), &blockx, &blocky);
+	if (blocky < 1) {
+		blocky = 1;
 	}
-
-	// Compute the area for each morph grid cell size
-	for (j = 0; j < mgrid->ysize; j++) {
-		for (i = 0; i < mgrid->xsize; i++) {
-			
-			idx = j*mgrid->xsize + i;
-			ax = mgrid->x[i][j];
-			ay = mgrid->y[i][j];
-			bx = mgrid->x[i+1][j];
-			by = mgrid->y[i+1][j];
-			cx = mgrid->x[i][j+1];
-			cy = mgrid->y[i][j+1];
-			dx = mgrid->x[i+1][j+1];
-			dy = mgrid->y[i+1][j+1];
-			
-			s1 = 0.5 * ABS((dx-ax)*(by-ay) - (dy-ay)*(bx-ax));
-			s2 = 0.5 * ABS((dx-cx)*(by-cy) - (dy-cy)*(bx-cx));
+	block_rows = (blocky >= AG_BLOCK_ROWS) ? blocky : (AG_BLOCK_ROWS / blocky) * blocky;
+	if (block_rows > mgrid->ysize) {
+		block_rows = mgrid->ysize;
+	}
+	nblocks = (mgrid->ysize + block_rows - 1) / block_rows;
+	
+	// Allocate the memory for holding two blocks of all bands.
+	for (i = 0; i < 2; i++) {
+		buf[i] = malloc((size_t)nbands * mgrid->xsize * block_rows * sizeof(double));
+		if (buf[i] == NULL) {
+			fprintf(stderr, "Error. Not enough memory.\n");
+			exit(1);
+		}
+	}
+	
+	mean_area = (nbands > 1) ? grid_mean_area(mgrid) : 1.0;
+	
+	// Compute the area for each morph grid cell size, in a pipeline: while
+	// one thread writes the previous block, the other threads compute the
+	// current one. Within a block, every thread computes whole columns, as
+	// the grid is stored column by column.
+	write_errors = 0;
+	for (t = 0; t <= nblocks; t++) {
+		
+		cur = buf[t % 2];
+		prev = buf[(t+1) % 2];
+		
+#pragma omp parallel default(shared) private(i, b, nrows, out_band)
+		{
+#pragma omp single nowait
+			{
+				if (t > 0) {
+					
+					// Write the previous block. The buffer is column-major,
+					// which is given to GDAL with the pixel and line spacing.
+					nrows = MIN(block_rows, mgrid->ysize - (t-1)*block_rows);
+					for (b = 0; b < nbands; b++) {
+						out_band = GDALGetRasterBand(out_ds, b+1);
+						if (GDALRasterIO(out_band, GF_Write, 0, (t-1)*block_rows, mgrid->xsize, nrows, 
+										 prev + (size_t)b*mgrid->xsize*nrows, 
+										 mgrid->xsize, nrows, GDT_Float64, 
+										 nrows * sizeof(double), sizeof(double)) != CE_None) {
+							write_errors++;
+						}
+					}
+				}
+			}
 			
-			rast[idx] = s1 + s2;
+			if (t < nblocks) {
+				nrows = MIN(block_rows, mgrid->ysize - t*block_rows);
+#pragma omp for schedule(dynamic, 64) nowait
+				for (i = 0; i < mgrid->xsize; i++) {
+					area_column(mgrid, i, t*block_rows, nrows, nbands, mean_area, cur);
+				}
+			}
 		}
 	}
 	
-	// Write the raster data
-	out_band = GDALGetRasterBand(out_ds, 1);
-	GDALRasterIO(out_band, GF_Write, 0, 0, mgrid->xsize, mgrid->ysize, rast, 
-				 mgrid->xsize, mgrid->ysize, GDT_Float64, 0, 0);
-	free(rast);
+	if (write_errors > 0) {
+		fprintf(stderr, "Error. Unable to write the output raster '%s'.\n", outfile);
+	}
+	
+	free(buf[0]);
+	free(buf[1]);
 	GDALClose(out_ds);
 	
 	free_morph(mgrid);
 	
 	return 0;
 }
-
-
-
-
-
-
-
-
-
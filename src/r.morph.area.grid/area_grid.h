@@ -12,7 +12,22 @@
 #  define ABS(x)        ((x<0) ? (-1*(x)) : x)
 #endif
 
+#ifndef MIN
+#  define MIN(a, b)     (((a) < (b)) ? (a) : (b))
+#endif
+
+
+// Minimum number of rows computed and written at once.
+#define AG_BLOCK_ROWS 256
 
 
 
-int area_grid (char *infile, char *outfile, char *format);
+
+/*
+ * Writes the area of every cell of the morph grid infile to the raster
+ * outfile. If distortion is set, three more bands are written: the area
+ * relative to the mean cell area, the maximum angular distortion (in
+ * degrees) and the largest local scale factor relative to the mean cell
+ * size.
+ */
+int area_grid (char *infile, char *outfile, char *format, int distortion);
@@ -7,7 +7,7 @@
  
  Syntax:
  r.morph.area.grid --input MORPH_FILE --output OUTPUT_RASTER
- [--format FORMAT]
+ [--format FORMAT] [--distortion]
  
  Version:	1.0.0
  Date:		13.2.2011
@@ -35,7 +35,7 @@ static char *usage[] = {
 	"      morphing grid cell.\n",
 	"   SYNOPSIS\n",
 	"      r.morph.area.grid [--help] --input MORPH_FILE --output OUTPUT_RASTER\n",
-	"         [--format FORMAT]\n",
+	"         [--format FORMAT] [--distortion]\n",
 	"   DESCRIPTION\n",
 	"      The following options are available:\n",
 	"         --help       Shows this usage note.\n",
@@ -52,6 +52,10 @@ static char *usage[] = {
 	"                      need a special library and is depending of the \n",
 	"                      installed OGR library.\n",
 	"                      Default is 'ESRI Shapefile'.\n",
+	"         --distortion Writes three more bands: the area relative to the\n",
+	"                      mean cell area, the maximum angular distortion\n",
+	"                      in degrees, and the largest local scale factor\n",
+	"                      relative to the mean cell size.\n",
 	"   BUGS\n",
 	"      Please send any comments or bug reports to chri.kais@gmail.com.\n",
 	"   VERSION\n",
@@ -73,6 +77,7 @@ int main (int argc, const char *argv[]) {
 	int ok;
 	
 	char *infile, *outfile, *format;
+	int distortion;
 	
 	extern int optind;
 	extern int optopt;
@@ -88,6 +93,7 @@ int main (int argc, const char *argv[]) {
 	// Provide default values.
 	infile = outfile = NULL;
 	format = "HFA";
+	distortion = 0;
 	
 	
 	// Process command line
@@ -98,10 +104,11 @@ int main (int argc, const char *argv[]) {
 			{"input",			required_argument,	0,	'i'},
 			{"output",			required_argument,	0,	'o'},
 			{"format",			required_argument,	0,	'f'},
+			{"distortion",		no_argument,		0,	'd'},
 			{0, 0, 0, 0}
 		};
 		
-		c = getopt_long(argc, (char**)argv, "hi:o:f:", long_options, NULL);
+		c = getopt_long(argc, (char**)argv, "hi:o:f:d", long_options, NULL);
 		if (c == -1) {
 			break;
 		}
@@ -119,6 +126,9 @@ int main (int argc, const char *argv[]) {
 			case 'f':
 				format = optarg;
 				break;
+			case 'd':
+				distortion = 1;
+				break;
 			case '?':
 				return 1;
 			default:
@@ -140,7 +150,7 @@ int main (int argc, const char *argv[]) {
 	
 	
 	printf("r.morph.area.grid starting\n");
-	ok = area_grid(infile, outfile, format);
+	ok = area_grid(infile, outfile, format, distortion);
 	printf("r.morph.area.grid done\n");
 	
 	return ok;
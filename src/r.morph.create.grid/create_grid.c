@@ -21,18 +21,75 @@
 
 
 
-int create_grid(char *infile, char *outfile, int gridsize, char *format, char *layer) {
+/*
+ * Writes one grid line as a new feature. The feature and the field indices
+ * are reused for all lines; the geometry is allocated with all its points
+ * before being handed over to the feature.
+ */
+static void write_line(OGRLayerH lyr, OGRFeatureH feat, int *fields, 
+					   int fid, int row, int col, double *x, double *y, int n) {
+	
+	OGRGeometryH geom;
+#ifndef HAVE_OGR_POINT_ARRAYS
+	int i;
+#endif
+	
+	OGR_F_SetFID(feat, OGRNullFID);
+	OGR_F_SetFieldInteger(feat, fields[0], fid);
+	OGR_F_SetFieldInteger(feat, fields[1], row);
+	OGR_F_SetFieldInteger(feat, fields[2], col);
+	
+	geom = OGR_G_CreateGeometry(wkbLineString);
+#ifdef HAVE_OGR_POINT_ARRAYS
+	OGR_G_SetPoints(geom, n, x, sizeof(double), y, sizeof(double), NULL, 0);
+#else
+	OGR_G_SetPointCount(geom, n);
+	for (i = 0; i < n; i++) {
+		OGR_G_SetPoint_2D(geom, i, x[i], y[i]);
+	}
+#endif
+	OGR_F_SetGeometryDirectly(feat, geom);
+	
+	if (OGR_L_CreateFeature(lyr, feat) != OGRERR_NONE) {
+		fprintf(stderr, "Error. Unable to create new feature.\n");
+		exit(1);
+	}
+}
+
+
+
+/*
+ * Commits the running transaction after every transaction_size features
+ * and starts a new one. Does nothing if the layer has no transactions.
+ */
+static void next_transaction(OGRLayerH lyr, int transaction_size, int nfeat) {
+	if (transaction_size <= 0 || nfeat % transaction_size != 0) {
+		return;
+	}
+	if (OGR_L_CommitTransaction(lyr) != OGRERR_NONE || 
+		OGR_L_StartTransaction(lyr) != OGRERR_NONE) {
+		fprintf(stderr, "Error. Unable to commit features to the output layer.\n");
+		exit(1);
+	}
+}
+
+
+
+int create_grid(char *infile, char *outfile, int gridsize, char *format, char *layer, 
+				int transaction_size) {
 
 	OGRSFDriverH out_driver;
 	OGRDataSourceH out_ds;
 	OGRLayerH out_layer;
 	OGRFieldDefnH field;
+	OGRFeatureDefnH defn;
 	OGRFeatureH feat;
-	OGRGeometryH geom;
 	morph *mgrid;
 	int xstep, ystep, step;
 	double topleftx, toplefty, weres, nsres, rot1, rot2;
-	int i,j, fid, row, col;
+	double *x, *y;
+	int i,j, fid, row, col, n;
+	int fields[3];
 	
 	
 	OGRRegisterAll();
@@ -115,35 +172,42 @@ int create_grid(char *infile, char *outfile, int gridsize, char *format, char *l
 	rot2 = mgrid->georef[4];
 	nsres = mgrid->georef[5];
 	
+	// Look up the attribute indices once, and reuse the same feature
+	// for all lines.
+	defn = OGR_L_GetLayerDefn(out_layer);
+	fields[0] = OGR_FD_GetFieldIndex(defn, "ID");
+	fields[1] = OGR_FD_GetFieldIndex(defn, "ROW");
+	fields[2] = OGR_FD_GetFieldIndex(defn, "COL");
+	feat = OGR_F_Create(defn);
+	
+	// Coordinate buffers for the longest line.
+	n = (mgrid->xsize > mgrid->ysize) ? mgrid->xsize : mgrid->ysize;
+	x = (double*)malloc(n * sizeof(double));
+	y = (double*)malloc(n * sizeof(double));
+	if (x == NULL || y == NULL) {
+		fprintf(stderr, "Error. Not enough memory.\n");
+		exit(1);
+	}
+	
+	// Write the features in batches of transaction_size features. Drivers
+	// without transactions get one feature at a time.
+	if (!OGR_L_TestCapability(out_layer, OLCTransactions)) {
+		transaction_size = 0;
+	}
+	if (transaction_size > 0 && OGR_L_StartTransaction(out_layer) != OGRERR_NONE) {
+		transaction_size = 0;
+	}
+	
 	// Write all horizontal lines.
 	fid = 1;
 	row = 1;
 	for (j = 0; j < mgrid->ysize; j += step) {
-		// Create a new Feature with the projected coordinates.
-		feat = OGR_F_Create(OGR_L_GetLayerDefn(out_layer));
-		OGR_F_SetFieldInteger(feat, OGR_F_GetFieldIndex(feat, "ID"), fid);
-		OGR_F_SetFieldInteger(feat, OGR_F_GetFieldIndex(feat, "ROW"), row);
-		OGR_F_SetFieldInteger(feat, OGR_F_GetFieldIndex(feat, "COL"), 0);
-
-		// Create a new geometry object.
-		geom = OGR_G_CreateGeometry(wkbLineString);
 		for (i = 0; i < mgrid->xsize; i++) {
-			OGR_G_SetPoint_2D(
-							  geom, 
-							  i, 
-							  topleftx + mgrid->x[i][j]*weres + mgrid->y[i][j]*rot1, 
-							  toplefty + mgrid->x[i][j]*rot2 + mgrid->y[i][j]*nsres);
-		}
-		OGR_F_SetGeometry(feat, geom);
-		OGR_G_DestroyGeometry(geom);
-		
-		// Write the feature to the output vector layer.
-		if (OGR_L_CreateFeature(out_layer, feat) != OGRERR_NONE) {
-			fprintf(stderr, "Error. Unable to create new feature.\n");
-			exit(1);
+			x[i] = topleftx + MORPH_X(mgrid, i, j)*weres + MORPH_Y(mgrid, i, j)*rot1;
+			y[i] = toplefty + MORPH_X(mgrid, i, j)*rot2 + MORPH_Y(mgrid, i, j)*nsres;
 		}
-		OGR_F_Destroy(feat);
-		
+		write_line(out_layer, feat, fields, fid, row, 0, x, y, mgrid->xsize);
+		next_transaction(out_layer, transaction_size, fid);
 		row++;
 		fid++;
 	}
@@ -151,34 +215,23 @@ int create_grid(char *infile, char *outfile, int gridsize, char *format, char *l
 	// Write all vertical lines.
 	col = 1;
 	for (i = 0; i < mgrid->xsize; i += step) {
-		// Create a new Feature with the projected coordinates.
-		feat = OGR_F_Create(OGR_L_GetLayerDefn(out_layer));
-		OGR_F_SetFieldInteger(feat, OGR_F_GetFieldIndex(feat, "ID"), fid);
-		OGR_F_SetFieldInteger(feat, OGR_F_GetFieldIndex(feat, "ROW"), 0);
-		OGR_F_SetFieldInteger(feat, OGR_F_GetFieldIndex(feat, "COL"), col);
-		
-		// Create a new geometry object.
-		geom = OGR_G_CreateGeometry(wkbLineString);
 		for (j = 0; j < mgrid->ysize; j++) {
-			OGR_G_SetPoint_2D(
-							  geom, 
-							  j, 
-							  topleftx + mgrid->x[i][j]*weres + mgrid->y[i][j]*rot1, 
-							  toplefty + mgrid->x[i][j]*rot2 + mgrid->y[i][j]*nsres);
+			x[j] = topleftx + MORPH_X(mgrid, i, j)*weres + MORPH_Y(mgrid, i, j)*rot1;
+			y[j] = toplefty + MORPH_X(mgrid, i, j)*rot2 + MORPH_Y(mgrid, i, j)*nsres;
 		}
-		OGR_F_SetGeometry(feat, geom);
-		OGR_G_DestroyGeometry(geom);
-		
-		// Write the feature to the output vector layer.
-		if (OGR_L_CreateFeature(out_layer, feat) != OGRERR_NONE) {
-			fprintf(stderr, "Error. Unable to create new feature.\n");
-			exit(1);
-		}
-		OGR_F_Destroy(feat);
-		
+		write_line(out_layer, feat, fields, fid, 0, col, x, y, mgrid->ysize);
+		next_transaction(out_layer, transaction_size, fid);
 		col++;
 		fid++;
 	}
+	
+	if (transaction_size > 0 && OGR_L_CommitTransaction(out_layer) != OGRERR_NONE) {
+		fprintf(stderr, "Error. Unable to commit features to the output layer.\n");
+		exit(1);
+	}
+	OGR_F_Destroy(feat);
+	free(x);
+	free(y);
 
 	// Close the datasources and free the memory.
 	OGR_DS_Destroy(out_ds);
@@ -8,5 +8,17 @@
  */
 
 
-int create_grid(char *infile, char *outfile, int gridsize, char *format, char *layer);
+/*
+ * Default number of features written per transaction.
+ */
+#define CG_TRANSACTION_SIZE 10000
+
+
+/*
+ * Writes the morphing grid lines to a new OGR layer. With transactional
+ * drivers (GeoPackage, SQLite, PostGIS...), the features are committed in
+ * batches of transaction_size features; 0 disables the transactions.
+ */
+int create_grid(char *infile, char *outfile, int gridsize, char *format, char *layer, 
+				int transaction_size);
 
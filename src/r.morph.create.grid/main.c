@@ -7,6 +7,7 @@
  Syntax:
  r.morph.create.grid --input MORPH_FILE --output OUTPUT_VECTOR 
  --gridsize GRID_SIZE [--format FORMAT] [--layer LAYER_NAME]
+ [--transaction N]
  
  Version:	1.0.0
  Date:		13.1.2011
@@ -34,6 +35,7 @@ static char *usage[] = {
 	"   SYNOPSIS\n",
 	"      r.morph.create.grid [--help] --input MORPH_FILE --output OUTPUT_VECTOR\n",
 	"         --gridsize GRID_SIZE [--format FORMAT] [--layer LAYER_NAME]\n",
+	"         [--transaction N]\n",
 	"   DESCRIPTION\n",
 	"      The following options are available:\n",
 	"         --help       Shows this usage note.\n",
@@ -53,6 +55,10 @@ static char *usage[] = {
 	"                      Default is 'ESRI Shapefile'.\n",
 	"         --layer      An optional layer name (depending on the chosen\n",
 	"                      output format. Default is 'morph_grid'.\n",
+	"         --transaction Number of features written per transaction\n",
+	"                      for formats supporting transactions (GeoPackage,\n",
+	"                      SQLite, PostgreSQL/PostGIS...). 0 disables the\n",
+	"                      transactions. Default is 10000.\n",
 	"   BUGS\n",
 	"      Please send any comments or bug reports to chri.kais@gmail.com.\n",
 	"   VERSION\n",
@@ -74,7 +80,7 @@ int main (int argc, const char *argv[]) {
 	int ok;
 	
 	char *infile, *outfile, *format, *layer;
-	int gridsize;
+	int gridsize, transaction_size;
 	
 	extern int optind;
 	extern int optopt;
@@ -92,6 +98,7 @@ int main (int argc, const char *argv[]) {
 	format = "ESRI Shapefile";
 	layer = "morph_grid";
 	gridsize = 0;
+	transaction_size = CG_TRANSACTION_SIZE;
 	
 	
 	// Process command line
@@ -104,10 +111,11 @@ int main (int argc, const char *argv[]) {
 			{"gridsize",		required_argument,	0,	'g'},
 			{"format",			required_argument,	0,	'f'},
 			{"layer",			required_argument,	0,	'l'},
+			{"transaction",		required_argument,	0,	't'},
 			{0, 0, 0, 0}
 		};
 		
-		c = getopt_long(argc, (char**)argv, "hi:o:g:f:l:", long_options, NULL);
+		c = getopt_long(argc, (char**)argv, "hi:o:g:f:l:t:", long_options, NULL);
 		if (c == -1) {
 			break;
 		}
@@ -131,6 +139,9 @@ int main (int argc, const char *argv[]) {
 			case 'l':
 				layer = optarg;
 				break;
+			case 't':
+				transaction_size = atol(optarg);
+				break;
 			case '?':
 				return 1;
 			default:
@@ -153,10 +164,14 @@ int main (int argc, const char *argv[]) {
 		fprintf(stderr, "Error. You must supply a grid size.\n");
 		exit(1);
 	}
+	if (transaction_size < 0) {
+		fprintf(stderr, "Error. The transaction size must be positive or 0.\n");
+		exit(1);
+	}
 	
 	
 	printf("r.morph.create.grid starting\n");
-	ok = create_grid(infile, outfile, gridsize, format, layer);
+	ok = create_grid(infile, outfile, gridsize, format, layer, transaction_size);
 	printf("r.morph.create.grid done\n");
 	
 	return ok;
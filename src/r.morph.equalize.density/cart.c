@@ -0,0 +1,1644 @@
+/* 
+ * Cartogram code of r.morph.equalize.density, based on the Gastner-Newman
+ * cartogram program written by Mark Newman (see equalize_density.c).
+ *
+ * This file is compiled twice: on its own it gives the double precision
+ * version (functions cart_*), and cart_float.c includes it with CART_SINGLE
+ * defined, which gives the single precision version (functions cartf_*).
+ * In single precision the density, its FFTs and the velocity grids are
+ * stored as float and transformed with fftwf; the grid points and the
+ * integration remain in double precision.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "fftw3.h"
+
+#include "equalize_density.h"
+
+
+
+#ifdef CART_SINGLE
+
+typedef float real;
+
+#define WISDOM_SUFFIX "_single"
+
+// Single precision FFTW
+#define fftw_plan fftwf_plan
+#define fftw_malloc fftwf_malloc
+#define fftw_free fftwf_free
+#define fftw_plan_r2r_2d fftwf_plan_r2r_2d
+#define fftw_execute fftwf_execute
+#define fftw_destroy_plan fftwf_destroy_plan
+#define fftw_import_wisdom_from_filename fftwf_import_wisdom_from_filename
+#define fftw_export_wisdom_to_filename fftwf_export_wisdom_to_filename
+
+// Single precision versions of the functions
+#define cart_solve cartf_solve
+#define cart_solvepoints cartf_solvepoints
+#define cart_downsample cartf_downsample
+#define cart_morphdensity cartf_morphdensity
+#define cart_multires cartf_multires
+#define cart_multirespoints cartf_multirespoints
+#define cart_dmalloc cartf_dmalloc
+#define cart_dfree cartf_dfree
+#define cart_makews cartf_makews
+#define cart_freews cartf_freews
+#define cart_forward cartf_forward
+#define cart_transform cartf_transform
+#define cart_density cartf_density
+#define cart_vgrid cartf_vgrid
+#define cart_gridvelocity cartf_gridvelocity
+#define cart_velocity cartf_velocity
+#define cart_twosteps cartf_twosteps
+#define cart_heunstep cartf_heunstep
+#define cart_makecart cartf_makecart
+#define cart_flow cartf_flow
+
+#else
+
+typedef double real;
+
+#define WISDOM_SUFFIX ""
+
+#endif
+
+
+
+// Constants
+#define INITH 0.001          // Initial size of a time-step
+#define TARGETERROR 0.01     // Desired accuracy per step in pixels
+#define MAXRATIO 4.0         // Max ratio to increase step size by
+#define EXPECTEDTIME 1.0e8   // Guess as to the time it will take, used to
+							 // estimate completion
+#define CHUNK 1024           // Number of points integrated at once by a thread
+#define REFINEH 0.1          // Initial size of a time-step when refining
+#define REFINERATIO 16.0     // Max ratio to increase step size by when refining
+#define REFINEDR 1.0e-3      // Displacement per step (in pixels) below which
+                             // a refinement level is finished
+#define MORPHSAMPLES 4.0     // Samples per pixel length in cart_morphdensity()
+#define FLOWINITH 0.001      // Initial size of a time-step of the flow method
+#define FLOWAREAERROR 0.01   // Area error below which the flow method stops
+#define FLOWAREAERRORLA 0.05 // Same with the less accurate variant
+#define FLOWMAXITER 10       // Maximum number of iterations of the flow method
+
+#define PI 3.1415926535897932384626
+
+
+/* Globals.  They are static, so that the double and the single precision
+ * versions of the cartogram code each have their own */
+
+static real *rhot[5];         // Pop density at time t (five snaps needed, two
+                              // with the less accurate stepping)
+static real *fftrho;          // FT of initial density
+static real *fftexpt;         // FT of density at time t
+
+static real *vxt[5];          // x-velocity at time t
+static real *vyt[5];          // y-velocity at time t
+static real *vbuf;            // Single buffer holding all the velocity grids,
+                              // or NULL if the velocity is computed on demand
+
+static real *expky;           // Array needed for the Gaussian convolution
+
+static fftw_plan rhotplan[5]; // Plan for rho(t) back-transform at time t
+
+static int nsnaps;            // Number of snapshots in use
+
+static real *flowgx;          // x-flux of the flow method at the grid points
+static real *flowgy;          // y-flux of the flow method at the grid points
+static real *flowrho;         // Initial density at the grid points
+
+
+
+/* Prototypes, with the precision of this version */
+
+real** cart_dmalloc(int xsize, int ysize);
+void cart_dfree(real **userrho);
+void cart_makews(int xsize, int ysize, int fast, int accurate);
+void cart_freews(void);
+void cart_transform(real **userrho, int xsize, int ysize);
+void cart_makecart(double *pointx, double *pointy, int npoints, int xsize, int ysize, double blur, 
+				   int accurate, int refine);
+void cart_solve(real **rho, double *gridx, double *gridy, int xsize, int ysize,
+				int fast, int accurate, char *wisdom, int refine);
+void cart_solvepoints(real **rho, double *pointx, double *pointy, int npoints, 
+					  int xsize, int ysize, int fast, int accurate, char *wisdom, int refine);
+real** cart_downsample(real **rho, int xsize, int ysize, int lx, int ly);
+real** cart_morphdensity(real **rho, double *gx, double *gy, int xsize, int ysize);
+void cart_multires(real **rho, double *gridx, double *gridy, int xsize, int ysize, 
+				   int levels, int fast, int accurate, char *wisdom);
+void cart_multirespoints(real **rho, double *pointx, double *pointy, int npoints,
+						 int xsize, int ysize, int levels, int fast, int accurate, char *wisdom);
+int cart_complete(double t);
+void cart_flow(real **rho, double *gridx, double *gridy, int xsize, int ysize, int accurate);
+
+
+
+
+/* Function to move the grid points gridx, gridy (row-major, see creategrid)
+ * to the cartogram of the density rho.  See cart_solvepoints() */
+void cart_solve(real **rho, double *gridx, double *gridy, int xsize, int ysize,
+				int fast, int accurate, char *wisdom, int refine)
+{
+	cart_solvepoints(rho, gridx, gridy, (xsize+1)*(ysize+1), xsize, ysize, 
+					 fast, accurate, wisdom, refine);
+}
+
+
+
+/* Function to move the points pointx, pointy (in pixels) to the cartogram
+ * of the density rho.  The points do not need to be at their initial
+ * position.  The workspace is allocated and freed here, and rho is freed
+ * as soon as it has been transformed.  If wisdom is not NULL, the FFTW
+ * wisdom is cached in this directory.  If refine is set, the points are
+ * already close to their final position (see cart_makecart) */
+void cart_solvepoints(real **rho, double *pointx, double *pointy, int npoints, 
+					  int xsize, int ysize, int fast, int accurate, char *wisdom, int refine)
+{
+	char wisdom_file[1024];         // FFTW wisdom for the grid size.
+	int nthreads;
+	
+	nthreads = 1;
+#if defined (_OPENMP)
+	nthreads = omp_get_max_threads();
+#endif
+	
+	/* Load the FFTW wisdom of a previous run with the same grid size, 
+	 * which makes planning the FFTs nearly free */
+	
+	if (wisdom != NULL) {
+		snprintf(wisdom_file, sizeof(wisdom_file), "%s/fftw_wisdom_%ix%i_%it%s.txt", 
+				 wisdom, xsize, ysize, nthreads, WISDOM_SUFFIX);
+		fftw_import_wisdom_from_filename(wisdom_file);
+	}
+	
+	/* Allocate space for the cartogram code to use */
+	
+	cart_makews(xsize, ysize, fast, accurate);
+	
+	/* Save the wisdom, including the plans made above */
+	
+	if (wisdom != NULL) {
+		if (fftw_export_wisdom_to_filename(wisdom_file) == 0) {
+			fprintf(stderr, "Warning. Unable to write FFTW wisdom file `%s'\n", wisdom_file);
+		}
+	}
+	
+	/* Transform the density, then destroy it */
+	
+	cart_transform(rho, xsize, ysize);
+	cart_dfree(rho);
+	
+	/* Compute the cartogram */
+	
+	cart_makecart(pointx, pointy, npoints, xsize, ysize, 0.0, accurate, refine);
+	
+	cart_freews();
+}
+
+
+
+/* Function to average the density rho (xsize*ysize) over the cells of a
+ * coarser lx*ly grid.  Every pixel belongs to the coarse cell in which its
+ * upper left corner lies */
+real** cart_downsample(real **rho, int xsize, int ysize, int lx, int ly)
+{
+	int ix,iy,cx,cy;
+	real **lrho;
+	int *count;
+	
+	lrho = cart_dmalloc(lx, ly);
+	count = calloc((size_t)lx*ly, sizeof(int));
+	memset(*lrho, 0, (size_t)lx*ly*sizeof(real));
+	
+	for (ix = 0; ix < xsize; ix++) {
+		cx = (int)((long)ix * lx / xsize);
+		for (iy = 0; iy < ysize; iy++) {
+			cy = (int)((long)iy * ly / ysize);
+			lrho[cx][cy] += rho[ix][iy];
+			count[cx*ly+cy]++;
+		}
+	}
+	
+	for (ix = 0; ix < lx*ly; ix++) {
+		(*lrho)[ix] /= count[ix];
+	}
+	
+	free(count);
+	return lrho;
+}
+
+
+
+#ifndef CART_SINGLE
+
+/* Function to place the points of a lx*ly grid according to the
+ * displacement of a coarser plx*ply grid, by bilinear interpolation.
+ * Shared by both precisions */
+void cart_upsample(double *pgx, double *pgy, int plx, int ply,
+				   double *gx, double *gy, int lx, int ly)
+{
+	int ix,iy,cx,cy;
+	size_t k00,k10,k01,k11;
+	double u,v,dx,dy,x,y;
+	
+#pragma omp parallel for default(shared) private(ix, iy, cx, cy, k00, k10, k01, k11, u, v, dx, dy, x, y)
+	for (iy = 0; iy <= ly; iy++) {
+		v = (double)iy * ply / ly;
+		cy = v;
+		if (cy >= ply) cy = ply - 1;
+		dy = v - cy;
+		for (ix = 0; ix <= lx; ix++) {
+			u = (double)ix * plx / lx;
+			cx = u;
+			if (cx >= plx) cx = plx - 1;
+			dx = u - cx;
+			k00 = (size_t)cy*(plx+1) + cx;
+			k10 = k00 + 1;
+			k01 = k00 + plx + 1;
+			k11 = k01 + 1;
+			x = (1-dx)*(1-dy)*pgx[k00] + dx*(1-dy)*pgx[k10] + (1-dx)*dy*pgx[k01] + dx*dy*pgx[k11];
+			y = (1-dx)*(1-dy)*pgy[k00] + dx*(1-dy)*pgy[k10] + (1-dx)*dy*pgy[k01] + dx*dy*pgy[k11];
+			gx[(size_t)iy*(lx+1)+ix] = x * lx / plx;
+			gy[(size_t)iy*(lx+1)+ix] = y * ly / ply;
+		}
+	}
+}
+
+
+
+/* Function to move the points pointx, pointy (in pixels of a xsize*ysize
+ * grid) according to the displacement of a coarser plx*ply grid, by
+ * bilinear interpolation.  Shared by both precisions */
+void cart_movepoints(double *pgx, double *pgy, int plx, int ply,
+					 double *pointx, double *pointy, int npoints, int xsize, int ysize)
+{
+	int p,cx,cy;
+	size_t k00,k10,k01,k11;
+	double u,v,dx,dy,x,y;
+	
+#pragma omp parallel for default(shared) private(p, cx, cy, k00, k10, k01, k11, u, v, dx, dy, x, y)
+	for (p = 0; p < npoints; p++) {
+		u = pointx[p] * plx / xsize;
+		v = pointy[p] * ply / ysize;
+		cx = u;
+		if (cx < 0) cx = 0;
+		else if (cx >= plx) cx = plx - 1;
+		cy = v;
+		if (cy < 0) cy = 0;
+		else if (cy >= ply) cy = ply - 1;
+		dx = u - cx;
+		dy = v - cy;
+		k00 = (size_t)cy*(plx+1) + cx;
+		k10 = k00 + 1;
+		k01 = k00 + plx + 1;
+		k11 = k01 + 1;
+		x = (1-dx)*(1-dy)*pgx[k00] + dx*(1-dy)*pgx[k10] + (1-dx)*dy*pgx[k01] + dx*dy*pgx[k11];
+		y = (1-dx)*(1-dy)*pgy[k00] + dx*(1-dy)*pgy[k10] + (1-dx)*dy*pgy[k01] + dx*dy*pgy[k11];
+		pointx[p] = x * xsize / plx;
+		pointy[p] = y * ysize / ply;
+	}
+}
+
+
+#endif
+
+
+
+/* Function to compute the density in the space of the displaced grid
+ * gx, gy.  The mass of every cell is spread over its displaced shape with
+ * regularly placed samples (more for large cells), and every sample is
+ * distributed to the four nearest pixels (cloud in cell).  The result
+ * is a new density array; the offset is added as in readpop() */
+real** cart_morphdensity(real **rho, double *gx, double *gy, int xsize, int ysize)
+{
+	int ix,iy,n,a,b,px,py;
+	size_t k00,k10,k01,k11;
+	double area,mass,u,v,x,y,fx,fy,sum;
+	real **mrho;
+	real *m;
+	
+	mrho = cart_dmalloc(xsize, ysize);
+	m = *mrho;
+	memset(m, 0, (size_t)xsize*ysize*sizeof(real));
+	
+	for (ix = 0; ix < xsize; ix++) {
+		for (iy = 0; iy < ysize; iy++) {
+			
+			k00 = (size_t)iy*(xsize+1) + ix;
+			k10 = k00 + 1;
+			k01 = k00 + xsize + 1;
+			k11 = k01 + 1;
+			
+			/* Number of samples along each side of the cell.  With fewer
+			 * than a few samples per pixel, the density is noisy */
+			
+			area = 0.5 * fabs((gx[k11]-gx[k00])*(gy[k01]-gy[k10]) - (gx[k01]-gx[k10])*(gy[k11]-gy[k00]));
+			n = ceil(MORPHSAMPLES*sqrt(area));
+			if (n < 1) n = 1;
+			if (n > 64) n = 64;
+			mass = rho[ix][iy] / (n*n);
+			
+			for (a = 0; a < n; a++) {
+				u = (a + 0.5) / n;
+				for (b = 0; b < n; b++) {
+					v = (b + 0.5) / n;
+					x = (1-u)*(1-v)*gx[k00] + u*(1-v)*gx[k10] + (1-u)*v*gx[k01] + u*v*gx[k11];
+					y = (1-u)*(1-v)*gy[k00] + u*(1-v)*gy[k10] + (1-u)*v*gy[k01] + u*v*gy[k11];
+					
+					/* Cloud in cell, with the pixel centres at half integers */
+					
+					x -= 0.5;
+					y -= 0.5;
+					if (x < 0) x = 0;
+					else if (x > xsize-1) x = xsize-1;
+					if (y < 0) y = 0;
+					else if (y > ysize-1) y = ysize-1;
+					px = x;
+					py = y;
+					if (px > xsize-2) px = (xsize > 1) ? xsize-2 : 0;
+					if (py > ysize-2) py = (ysize > 1) ? ysize-2 : 0;
+					fx = x - px;
+					fy = y - py;
+					m[px*ysize+py] += (1-fx)*(1-fy)*mass;
+					if (xsize > 1) m[(px+1)*ysize+py] += fx*(1-fy)*mass;
+					if (ysize > 1) m[px*ysize+py+1] += (1-fx)*fy*mass;
+					if (xsize > 1 && ysize > 1) m[(px+1)*ysize+py+1] += fx*fy*mass;
+				}
+			}
+		}
+	}
+	
+	/* Add the same bias as readpop() */
+	
+	sum = 0.0;
+	for (ix = 0; ix < xsize*ysize; ix++) sum += m[ix];
+	for (ix = 0; ix < xsize*ysize; ix++) m[ix] += OFFSET*sum/((double)xsize*ysize);
+	
+	return mrho;
+}
+
+
+
+/* Function to compute the coarse levels of the multiresolution cartogram
+ * (see cart_multires).  The number of levels is reduced if needed, so that
+ * the coarsest grid has at least 8 cells in each direction, and returned.
+ * If there is more than one level, the grid of level 1 (plx*ply cells) is
+ * returned in pgx, pgy, which must be freed by the caller */
+static int cart_coarse(real **rho, int xsize, int ysize, int levels, int fast, int accurate, 
+					   char *wisdom, double **pgxp, double **pgyp, int *plxp, int *plyp)
+{
+	int l,lx,ly,plx,ply;
+	real **lrho,**mrho;
+	double *gx,*gy,*pgx,*pgy;
+	
+	/* The coarsest grid should have at least 8 cells in each direction */
+	
+	while (levels > 1 && ((xsize >> (levels-1)) < 8 || (ysize >> (levels-1)) < 8)) {
+		levels--;
+	}
+	
+	pgx = pgy = NULL;
+	plx = ply = 0;
+	
+	for (l = levels-1; l > 0; l--) {
+		
+		/* Size of the grid at this level, and the points to move */
+		
+		lx = xsize >> l;
+		ly = ysize >> l;
+		gx = malloc((size_t)(lx+1)*(ly+1)*sizeof(double));
+		gy = malloc((size_t)(lx+1)*(ly+1)*sizeof(double));
+		lrho = cart_downsample(rho, xsize, ysize, lx, ly);
+		
+		if (pgx == NULL) {
+			creategrid(gx, gy, lx, ly);
+		} else {
+			
+			/* Start from the coarser cartogram, and compute the density
+			 * that remains to be equalized */
+			
+			cart_upsample(pgx, pgy, plx, ply, gx, gy, lx, ly);
+			free(pgx);
+			free(pgy);
+			mrho = cart_morphdensity(lrho, gx, gy, lx, ly);
+			cart_dfree(lrho);
+			lrho = mrho;
+		}
+		
+#ifndef NOPROGRESS
+		fprintf(stderr, "  Level %i: %i x %i\n", l, lx, ly);
+#endif
+		cart_solve(lrho, gx, gy, lx, ly, fast, accurate, wisdom, (l < levels-1));
+		
+		pgx = gx;
+		pgy = gy;
+		plx = lx;
+		ply = ly;
+	}
+	
+	*pgxp = pgx;
+	*pgyp = pgy;
+	*plxp = plx;
+	*plyp = ply;
+	
+	return levels;
+}
+
+
+
+/* Function to compute the cartogram coarse to fine.  The density is first
+ * averaged over a grid 2^(levels-1) times smaller in each direction, and
+ * the cartogram is computed on this grid.  At every finer level, the grid
+ * points are placed by interpolating the displacement of the coarser level,
+ * and the cartogram of the remaining density differences is computed
+ * starting from there.  As these differences are small and mostly local,
+ * the finer levels need only few steps.  The grid points gridx, gridy
+ * must be at their initial position, and rho is freed */
+void cart_multires(real **rho, double *gridx, double *gridy, int xsize, int ysize, 
+				   int levels, int fast, int accurate, char *wisdom)
+{
+	int plx,ply;
+	real **mrho;
+	double *pgx,*pgy;
+	
+	levels = cart_coarse(rho, xsize, ysize, levels, fast, accurate, wisdom, 
+						 &pgx, &pgy, &plx, &ply);
+	
+	if (levels > 1) {
+		
+		/* Start from the cartogram of level 1 */
+		
+		cart_upsample(pgx, pgy, plx, ply, gridx, gridy, xsize, ysize);
+		free(pgx);
+		free(pgy);
+		mrho = cart_morphdensity(rho, gridx, gridy, xsize, ysize);
+		cart_dfree(rho);
+		rho = mrho;
+	}
+	
+#ifndef NOPROGRESS
+	fprintf(stderr, "  Level 0: %i x %i\n", xsize, ysize);
+#endif
+	cart_solve(rho, gridx, gridy, xsize, ysize, fast, accurate, wisdom, (levels > 1));
+}
+
+
+
+/* Function to compute the cartogram of the points pointx, pointy (in
+ * pixels) coarse to fine.  The coarse levels are computed on grids as in
+ * cart_multires(), and only the points are moved at the finest level.
+ * The points must be at their initial position, and rho is freed */
+void cart_multirespoints(real **rho, double *pointx, double *pointy, int npoints,
+						 int xsize, int ysize, int levels, int fast, int accurate, char *wisdom)
+{
+	int plx,ply;
+	real **mrho;
+	double *gx,*gy,*pgx,*pgy;
+	
+	levels = cart_coarse(rho, xsize, ysize, levels, fast, accurate, wisdom, 
+						 &pgx, &pgy, &plx, &ply);
+	
+	if (levels > 1) {
+		
+		/* The remaining density is computed with the interpolated grid,
+		 * which is not integrated */
+		
+		gx = malloc((size_t)(xsize+1)*(ysize+1)*sizeof(double));
+		gy = malloc((size_t)(xsize+1)*(ysize+1)*sizeof(double));
+		cart_upsample(pgx, pgy, plx, ply, gx, gy, xsize, ysize);
+		mrho = cart_morphdensity(rho, gx, gy, xsize, ysize);
+		free(gx);
+		free(gy);
+		cart_dfree(rho);
+		rho = mrho;
+		
+		cart_movepoints(pgx, pgy, plx, ply, pointx, pointy, npoints, xsize, ysize);
+		free(pgx);
+		free(pgy);
+	}
+	
+#ifndef NOPROGRESS
+	fprintf(stderr, "  Level 0: %i points\n", npoints);
+#endif
+	cart_solvepoints(rho, pointx, pointy, npoints, xsize, ysize, 
+					 fast, accurate, wisdom, (levels > 1));
+}
+
+
+
+
+
+
+
+
+
+
+/* Function to make space for the density array.  This is done in such a
+ * way as to allow rho to be accessed either as a single block (for FFTW)
+ * or as a normal double-indexed array (for regular use) */
+real** cart_dmalloc(int xsize, int ysize)
+{
+	int ix;
+	real **userrho;
+	
+	userrho = malloc(xsize*sizeof(real*));
+	*userrho = fftw_malloc(xsize*ysize*sizeof(real));
+	for (ix = 1; ix < xsize; ix++) {
+		userrho[ix] = *userrho + ix*ysize;
+	}
+	
+	return userrho;
+}
+
+
+
+/* Function to free space for the density array */
+void cart_dfree(real **userrho)
+{
+	fftw_free(*userrho);
+	free(userrho);
+}
+
+
+
+/* Function to allocate space for the global arrays.  The velocity grids
+ * are only allocated if fast is set; otherwise the velocity is computed
+ * from the density when needed.  The less accurate stepping (accurate
+ * not set) needs only two snapshots instead of five */
+void cart_makews(int xsize, int ysize, int fast, int accurate)
+{
+	int s,i;
+	size_t npoints;
+	
+	nsnaps = accurate ? 5 : 2;
+	
+	/* Space for the FFT arrays is allocated single blocks, rather than using
+	 * a true two-dimensional array, because libfftw demands that it be so */
+	
+	for (s=0; s<nsnaps; s++) rhot[s] = fftw_malloc(xsize*ysize*sizeof(real));
+	fftrho = fftw_malloc(xsize*ysize*sizeof(real));
+	fftexpt = fftw_malloc(xsize*ysize*sizeof(real));
+	
+	/* The velocity grids are stored in one single block, each grid
+	 * in column-major order (see GRID_IDX) */
+	
+	vbuf = NULL;
+	if (fast) {
+		npoints = (size_t)(xsize+1)*(ysize+1);
+		vbuf = malloc(2*nsnaps*npoints*sizeof(real));
+		for (s=0; s<nsnaps; s++) {
+			vxt[s] = vbuf + 2*s*npoints;
+			vyt[s] = vbuf + (2*s+1)*npoints;
+		}
+	}
+	
+	expky = malloc(ysize*sizeof(real));
+	
+	/* Make plans for the back transforms */
+	
+	for (i=0; i<nsnaps; i++) {
+		rhotplan[i] = fftw_plan_r2r_2d(xsize,ysize,fftexpt,rhot[i],
+									   FFTW_REDFT01,FFTW_REDFT01,FFTW_MEASURE);
+	}
+}
+
+
+
+/* Function to free up space for the global arrays and destroy the FFT
+ * plans */
+void cart_freews(void)
+{
+	int s,i;
+	
+	for (s=0; s<nsnaps; s++) fftw_free(rhot[s]);
+	fftw_free(fftrho);
+	fftw_free(fftexpt);
+	
+	free(vbuf);
+	
+	free(expky);
+	
+	for (i=0; i<nsnaps; i++) fftw_destroy_plan(rhotplan[i]);
+}
+
+
+
+/* Function to calculate the discrete cosine transform of the input data.
+ * assumes its input is an fftw_malloced array in column-major form with
+ * size xsize*ysize */
+void cart_forward(real *rho, int xsize, int ysize)
+{
+	fftw_plan plan;
+	
+	plan = fftw_plan_r2r_2d(xsize,ysize,rho,fftrho,
+							FFTW_REDFT10,FFTW_REDFT10,FFTW_ESTIMATE);
+	fftw_execute(plan);
+	fftw_destroy_plan(plan);
+}
+
+
+
+/* Function to calculate the discrete cosine transform of the input data.
+ * This function is just a wrapper for forward(), so the user doesn't
+ * need to see the fftw-format density array */
+void cart_transform(real **userrho, int xsize, int ysize)
+{
+	cart_forward(*userrho,xsize,ysize);
+}
+
+
+
+/* Function to calculate the population density at arbitrary time by back-
+ * transforming and put the result in a particular rhot[] snapshot array.
+ * Calculates unnormalized densities, since FFTW gives unnormalized back-
+ * transforms, but this doesn't matter because the cartogram method is
+ * insensitive to variation in the density by a multiplicative constant */
+void cart_density(double t, int s, int xsize, int ysize) {
+	
+	int ix,iy;
+	double kx,ky;
+	real expkx;
+	
+	/* Calculate the expky array, to save time in the next part */
+	
+	
+#pragma omp parallel for default(shared) private(iy, ky)	
+	for (iy = 0; iy < ysize; iy++) {
+		ky = PI * iy / ysize;
+		expky[iy] = exp(-ky * ky * t);
+	}
+	
+	/* Multiply the FT of the density by the appropriate factors */
+#pragma omp parallel for default(shared) private(ix, kx, expkx, iy)
+	for (ix = 0; ix < xsize; ix++) {
+		kx = PI*ix/xsize;
+		expkx = exp(-kx*kx*t);
+		for (iy = 0; iy < ysize; iy++) {
+			fftexpt[ix*ysize+iy] = expkx*expky[iy]*fftrho[ix*ysize+iy];
+		}
+	}
+	
+	/* Perform the back-transform */
+	
+	fftw_execute(rhotplan[s]);
+}
+
+
+
+
+/* Function to calculate the velocity at all integer grid points for a
+ * specified snapshot */
+void cart_vgrid(int s, int xsize, int ysize)
+{
+	int ix,iy;
+	real r00,r10;
+	real r01,r11;
+	real mid;
+	real *vx,*vy;        // Column ix of the velocity grids
+	
+	/* Nothing to do if the velocity is computed on demand */
+	
+	if (vbuf == NULL) return;
+	
+	/* Do the corners */
+	
+	vxt[s][GRID_IDX(0,0,ysize)] = vyt[s][GRID_IDX(0,0,ysize)] = 0.0;
+	vxt[s][GRID_IDX(xsize,0,ysize)] = vyt[s][GRID_IDX(xsize,0,ysize)] = 0.0;
+	vxt[s][GRID_IDX(0,ysize,ysize)] = vyt[s][GRID_IDX(0,ysize,ysize)] = 0.0;
+	vxt[s][GRID_IDX(xsize,ysize,ysize)] = vyt[s][GRID_IDX(xsize,ysize,ysize)] = 0.0;
+	
+	/* Do the top border */
+	
+	r11 = rhot[s][0];
+	for (ix=1; ix<xsize; ix++) {
+		r01 = r11;
+		r11 = rhot[s][ix*ysize];
+		vxt[s][GRID_IDX(ix,0,ysize)] = -2*(r11-r01)/(r11+r01);
+		vyt[s][GRID_IDX(ix,0,ysize)] = 0.0;
+	}
+	
+	/* Do the bottom border */
+	
+	r10 = rhot[s][ysize-1];
+	for (ix=1; ix<xsize; ix++) {
+		r00 = r10;
+		r10 = rhot[s][ix*ysize+ysize-1];
+		vxt[s][GRID_IDX(ix,ysize,ysize)] = -2*(r10-r00)/(r10+r00);
+		vyt[s][GRID_IDX(ix,ysize,ysize)] = 0.0;
+	}
+	
+	/* Left edge */
+	
+	r11 = rhot[s][0];
+	for (iy=1; iy<ysize; iy++) {
+		r10 = r11;
+		r11 = rhot[s][iy];
+		vxt[s][GRID_IDX(0,iy,ysize)] = 0.0;
+		vyt[s][GRID_IDX(0,iy,ysize)] = -2*(r11-r10)/(r11+r10);
+	}
+	
+	/* Right edge */
+	
+	r01 = rhot[s][(xsize-1)*ysize];
+	for (iy=1; iy<ysize; iy++) {
+		r00 = r01;
+		r01 = rhot[s][(xsize-1)*ysize+iy];
+		vxt[s][GRID_IDX(xsize,iy,ysize)] = 0.0;
+		vyt[s][GRID_IDX(xsize,iy,ysize)] = -2*(r01-r00)/(r01+r00);
+	}
+	
+	/* Now do all the points in the middle */
+#pragma omp parallel for default(shared) private(ix, r01, r11, iy, r00, r10, mid, vx, vy)
+	for (ix = 1; ix < xsize; ix++) {
+		vx = vxt[s] + GRID_IDX(ix,0,ysize);
+		vy = vyt[s] + GRID_IDX(ix,0,ysize);
+		r01 = rhot[s][(ix-1)*ysize];
+		r11 = rhot[s][ix*ysize];
+		for (iy = 1; iy < ysize; iy++) {
+			r00 = r01;
+			r10 = r11;
+			r01 = rhot[s][(ix-1)*ysize+iy];
+			r11 = rhot[s][ix*ysize+iy];
+			mid = r10 + r00 + r11 + r01;
+			vx[iy] = -2 * (r10-r00+r11-r01) / mid;
+			vy[iy] = -2 * (r01-r00+r11-r10) / mid;
+		}
+	}
+}
+
+
+
+
+/* Function to calculate the velocity at the grid point ix,iy directly from
+ * the density of a snapshot, in the same way as cart_vgrid().  Used when
+ * the velocity grids are not stored */
+void cart_gridvelocity(int ix, int iy, int s, int xsize, int ysize,
+					   double *vxp, double *vyp)
+{
+	real r00,r10;
+	real r01,r11;
+	real mid;
+	real *rho;
+	
+	rho = rhot[s];
+	*vxp = *vyp = 0.0;
+	
+	if (ix>0 && ix<xsize && iy>0 && iy<ysize) {
+		
+		/* Points in the middle */
+		
+		r00 = rho[(ix-1)*ysize+iy-1];
+		r10 = rho[ix*ysize+iy-1];
+		r01 = rho[(ix-1)*ysize+iy];
+		r11 = rho[ix*ysize+iy];
+		mid = r10 + r00 + r11 + r01;
+		*vxp = -2 * (r10-r00+r11-r01) / mid;
+		*vyp = -2 * (r01-r00+r11-r10) / mid;
+		
+	} else if (ix>0 && ix<xsize) {
+		
+		/* Top and bottom borders */
+		
+		if (iy==0) {
+			r00 = rho[(ix-1)*ysize];
+			r10 = rho[ix*ysize];
+		} else {
+			r00 = rho[(ix-1)*ysize+ysize-1];
+			r10 = rho[ix*ysize+ysize-1];
+		}
+		*vxp = -2*(r10-r00)/(r10+r00);
+		
+	} else if (iy>0 && iy<ysize) {
+		
+		/* Left and right edges */
+		
+		if (ix==0) {
+			r00 = rho[iy-1];
+			r01 = rho[iy];
+		} else {
+			r00 = rho[(xsize-1)*ysize+iy-1];
+			r01 = rho[(xsize-1)*ysize+iy];
+		}
+		*vyp = -2*(r01-r00)/(r01+r00);
+	}
+	
+	/* The velocity is zero in the corners */
+}
+
+
+
+/* Function to calculate the velocity at an arbitrary point from the grid
+ * velocities for a specified snapshot by interpolating between grid
+ * points.  If the requested point is outside the boundaries, we
+ * extrapolate (ensures smooth flow back in if we get outside by mistake,
+ * although we should never actually do this because function cart_twosteps()
+ * contains code to prevent it) */
+void cart_velocity(double rx, double ry, int s, int xsize, int ysize,
+				   double *vxp, double *vyp)
+{
+	int ix,iy;
+	size_t k0,k1;          // Index of the grid points ix,iy and ix+1,iy
+	double dx,dy;
+	double dx1m,dy1m;
+	double w11,w21,w12,w22;
+	double v11x,v11y,v21x,v21y,v12x,v12y,v22x,v22y;
+	
+	/* Deal with the boundary conditions */
+	
+	ix = rx;
+	if (ix<0) ix = 0;
+	else if (ix>=xsize) ix = xsize - 1;
+	
+	iy = ry;
+	if (iy<0) iy = 0;
+	else if (iy>=ysize) iy = ysize - 1;
+	
+	/* Calculate the weights for the bilinear interpolation */
+	
+	dx = rx - ix;
+	dy = ry - iy;
+	
+	dx1m = 1.0 - dx;
+	dy1m = 1.0 - dy;
+	
+	w11 = dx1m*dy1m;
+	w21 = dx*dy1m;
+	w12 = dx1m*dy;
+	w22 = dx*dy;
+	
+	/* Perform the interpolation for x and y components of velocity */
+	
+	if (vbuf == NULL) {
+		cart_gridvelocity(ix, iy, s, xsize, ysize, &v11x, &v11y);
+		cart_gridvelocity(ix+1, iy, s, xsize, ysize, &v21x, &v21y);
+		cart_gridvelocity(ix, iy+1, s, xsize, ysize, &v12x, &v12y);
+		cart_gridvelocity(ix+1, iy+1, s, xsize, ysize, &v22x, &v22y);
+		*vxp = w11*v11x + w21*v21x + w12*v12x + w22*v22x;
+		*vyp = w11*v11y + w21*v21y + w12*v12y + w22*v22y;
+		return;
+	}
+	
+	k0 = GRID_IDX(ix,iy,ysize);
+	k1 = k0 + ysize + 1;
+	
+	*vxp = w11*vxt[s][k0] + w21*vxt[s][k1] + w12*vxt[s][k0+1] + w22*vxt[s][k1+1];
+	*vyp = w11*vyt[s][k0] + w21*vyt[s][k1] + w12*vyt[s][k0+1] + w22*vyt[s][k1+1];
+}
+
+
+
+/* Function to integrate 2h time into the future two different ways using
+ * four-order Runge-Kutta and compare the differences for the purposes of
+ * the adaptive step size.  Parameters are:
+ *   *pointx = array of x-coords of points
+ *   *pointy = array of y-coords of points
+ *   npoints = number of points
+ *   t = current time, i.e., start time of these two steps
+ *   h = delta t
+ *   s = snapshot index of the initial time
+ *   xsize, ysize = size of grid
+ *   *errorp = the maximum integration error found for any polygon vertex for
+ *             the complete two-step process
+ *   *drp = maximum distance moved by any point
+ *   *spp = the snapshot index for the final function evaluation
+ */
+void cart_twosteps(double *pointx, double *pointy, int npoints,
+				   double t, double h, int s, int xsize, int ysize,
+				   double *errorp, double *drp, int *spp)
+{
+	int s0,s1,s2,s3,s4;
+	int p;
+	double rx1,ry1;
+	double rx2,ry2;
+	double rx3,ry3;
+	double v1x,v1y;
+	double v2x,v2y;
+	double v3x,v3y;
+	double v4x,v4y;
+	double k1x,k1y;
+	double k2x,k2y;
+	double k3x,k3y;
+	double k4x,k4y;
+	double dx1,dy1;
+	double dx2,dy2;
+	double dx12,dy12;
+	double dxtotal,dytotal;
+	double ex,ey;
+	double esq,esqmax,esqmax_t;
+	double drsq,drsqmax,drsqmax_t;
+	
+	s0 = s;
+	s1 = (s+1)%5;
+	s2 = (s+2)%5;
+	s3 = (s+3)%5;
+	s4 = (s+4)%5;
+	
+	/* Calculate the density field for the four new time slices */
+	
+	cart_density(t+0.5*h,s1,xsize,ysize);
+	cart_density(t+1.0*h,s2,xsize,ysize);
+	cart_density(t+1.5*h,s3,xsize,ysize);
+	cart_density(t+2.0*h,s4,xsize,ysize);
+	
+	/* Calculate the resulting velocity grids */
+	
+	cart_vgrid(s1,xsize,ysize);
+	cart_vgrid(s2,xsize,ysize);
+	cart_vgrid(s3,xsize,ysize);
+	cart_vgrid(s4,xsize,ysize);
+	
+	/* Do all three RK steps for each point in turn */
+	
+	/* Every thread keeps its own maxima, which are combined at the end.
+	 * The maxima do not depend on the order of the points, so the result
+	 * is the same for any number of threads */
+	
+	esqmax = drsqmax = 0.0;
+	
+#pragma omp parallel default(shared) private(p, rx1, ry1, v1x, v1y, k1x, k1y, v2x, v2y, k2x, k2y, v3x, v3y, k3x, k3y, v4x, v4y, k4x, k4y, dx12, dy12, dx1, dy1, rx2, ry2, dx2, dy2, ex, ey, esq, dxtotal, dytotal, drsq, rx3, ry3, esqmax_t, drsqmax_t)
+	{
+		esqmax_t = drsqmax_t = 0.0;
+		
+#pragma omp for schedule(static, CHUNK)
+		for (p = 0; p < npoints; p++) {
+			
+			rx1 = pointx[p];
+			ry1 = pointy[p];
+			
+			/* Do the big combined (2h) RK step */
+			
+			cart_velocity(rx1, ry1, s0, xsize, ysize, &v1x, &v1y);
+			k1x = 2*h*v1x;
+			k1y = 2*h*v1y;
+			cart_velocity(rx1+0.5*k1x, ry1+0.5*k1y, s2, xsize, ysize, &v2x, &v2y);
+			k2x = 2*h*v2x;
+			k2y = 2*h*v2y;
+			cart_velocity(rx1+0.5*k2x, ry1+0.5*k2y, s2, xsize, ysize, &v3x, &v3y);
+			k3x = 2*h*v3x;
+			k3y = 2*h*v3y;
+			cart_velocity(rx1+k3x, ry1+k3y, s4, xsize, ysize, &v4x, &v4y);
+			k4x = 2*h*v4x;
+			k4y = 2*h*v4y;
+			
+			dx12 = (k1x+k4x+2.0*(k2x+k3x))/6.0;
+			dy12 = (k1y+k4y+2.0*(k2y+k3y))/6.0;
+			
+			/* Do the first small RK step.  No initial call to cart_velocity() is done
+			 * because it would be the same as the one above, so there's no need
+			 * to do it again */
+			
+			k1x = h*v1x;
+			k1y = h*v1y;
+			cart_velocity(rx1+0.5*k1x, ry1+0.5*k1y, s1, xsize, ysize, &v2x, &v2y);
+			k2x = h*v2x;
+			k2y = h*v2y;
+			cart_velocity(rx1+0.5*k2x, ry1+0.5*k2y, s1, xsize, ysize, &v3x, &v3y);
+			k3x = h*v3x;
+			k3y = h*v3y;
+			cart_velocity(rx1+k3x, ry1+k3y, s2, xsize, ysize, &v4x, &v4y);
+			k4x = h*v4x;
+			k4y = h*v4y;
+			
+			dx1 = (k1x+k4x+2.0*(k2x+k3x))/6.0;
+			dy1 = (k1y+k4y+2.0*(k2y+k3y))/6.0;
+			
+			/* Do the second small RK step */
+			
+			rx2 = rx1 + dx1;
+			ry2 = ry1 + dy1;
+			
+			cart_velocity(rx2,ry2,s2,xsize,ysize,&v1x,&v1y);
+			k1x = h*v1x;
+			k1y = h*v1y;
+			cart_velocity(rx2+0.5*k1x,ry2+0.5*k1y,s3,xsize,ysize,&v2x,&v2y);
+			k2x = h*v2x;
+			k2y = h*v2y;
+			cart_velocity(rx2+0.5*k2x,ry2+0.5*k2y,s3,xsize,ysize,&v3x,&v3y);
+			k3x = h*v3x;
+			k3y = h*v3y;
+			cart_velocity(rx2+k3x,ry2+k3y,s4,xsize,ysize,&v4x,&v4y);
+			k4x = h*v4x;
+			k4y = h*v4y;
+			
+			dx2 = (k1x+k4x+2.0*(k2x+k3x))/6.0;
+			dy2 = (k1y+k4y+2.0*(k2y+k3y))/6.0;
+			
+			/* Calculate the (squared) error */
+			
+			ex = (dx1+dx2-dx12)/15;
+			ey = (dy1+dy2-dy12)/15;
+			esq = ex*ex + ey*ey;
+			if (esq > esqmax_t) {
+				esqmax_t = esq;
+			}
+			
+			/* Update the position of the vertex using the more accurate (two small
+			 * steps) result, and deal with the boundary conditions.  This code
+			 * does 5th-order "local extrapolation" (which just means taking
+			 * the estimate of the 5th-order term above and adding it to our
+			 * 4th-order result get a result accurate to the next highest order) */
+			
+			dxtotal = dx1 + dx2 + ex;   // Last term is local extrapolation
+			dytotal = dy1 + dy2 + ey;   // Last term is local extrapolation
+			drsq = dxtotal*dxtotal + dytotal*dytotal;
+			if (drsq > drsqmax_t) {
+				drsqmax_t = drsq;
+			}
+			
+			rx3 = rx1 + dxtotal;
+			ry3 = ry1 + dytotal;
+			
+			if (rx3<0) {
+				rx3 = 0;
+			}
+			else if (rx3>xsize) {
+				rx3 = xsize;
+			}
+			if (ry3<0) {
+				ry3 = 0;
+			}
+			else if (ry3>ysize) {
+				ry3 = ysize;
+			}
+			
+			pointx[p] = rx3;
+			pointy[p] = ry3;
+			
+		}
+			
+#pragma omp critical
+		{
+			if (esqmax_t > esqmax) esqmax = esqmax_t;
+			if (drsqmax_t > drsqmax) drsqmax = drsqmax_t;
+		}
+	}
+	
+	*errorp = sqrt(esqmax);
+	*drp =  sqrt(drsqmax);
+	*spp = s4;
+}
+
+
+
+/* Function to integrate h time into the future with Heun's method (second
+ * order Runge-Kutta), using the difference with the Euler step as error
+ * estimate.  Needs only the snapshots at t and t+h, which makes it faster
+ * and less memory hungry than cart_twosteps(), but less accurate.  The
+ * parameters are the same as for cart_twosteps() */
+void cart_heunstep(double *pointx, double *pointy, int npoints,
+				   double t, double h, int s, int xsize, int ysize,
+				   double *errorp, double *drp, int *spp)
+{
+	int s0,s1;
+	int p;
+	double rx1,ry1;
+	double rx2,ry2;
+	double v1x,v1y;
+	double v2x,v2y;
+	double dx,dy;
+	double ex,ey;
+	double esq,esqmax,esqmax_t;
+	double drsq,drsqmax,drsqmax_t;
+	
+	s0 = s;
+	s1 = (s+1)%nsnaps;
+	
+	/* Calculate the density field and the velocity grid at the end of
+	 * the step */
+	
+	cart_density(t+h,s1,xsize,ysize);
+	cart_vgrid(s1,xsize,ysize);
+	
+	esqmax = drsqmax = 0.0;
+	
+#pragma omp parallel default(shared) private(p, rx1, ry1, rx2, ry2, v1x, v1y, v2x, v2y, dx, dy, ex, ey, esq, drsq, esqmax_t, drsqmax_t)
+	{
+		esqmax_t = drsqmax_t = 0.0;
+		
+#pragma omp for schedule(static, CHUNK)
+		for (p = 0; p < npoints; p++) {
+			
+			rx1 = pointx[p];
+			ry1 = pointy[p];
+			
+			/* Euler predictor, then the trapezoidal corrector */
+			
+			cart_velocity(rx1, ry1, s0, xsize, ysize, &v1x, &v1y);
+			cart_velocity(rx1+h*v1x, ry1+h*v1y, s1, xsize, ysize, &v2x, &v2y);
+			
+			dx = 0.5*h*(v1x+v2x);
+			dy = 0.5*h*(v1y+v2y);
+			
+			/* The error is the difference with the Euler step */
+			
+			ex = 0.5*h*(v2x-v1x);
+			ey = 0.5*h*(v2y-v1y);
+			esq = ex*ex + ey*ey;
+			if (esq > esqmax_t) {
+				esqmax_t = esq;
+			}
+			
+			drsq = dx*dx + dy*dy;
+			if (drsq > drsqmax_t) {
+				drsqmax_t = drsq;
+			}
+			
+			rx2 = rx1 + dx;
+			ry2 = ry1 + dy;
+			
+			if (rx2<0) {
+				rx2 = 0;
+			}
+			else if (rx2>xsize) {
+				rx2 = xsize;
+			}
+			if (ry2<0) {
+				ry2 = 0;
+			}
+			else if (ry2>ysize) {
+				ry2 = ysize;
+			}
+			
+			pointx[p] = rx2;
+			pointy[p] = ry2;
+		}
+		
+#pragma omp critical
+		{
+			if (esqmax_t > esqmax) esqmax = esqmax_t;
+			if (drsqmax_t > drsqmax) drsqmax = drsqmax_t;
+		}
+	}
+	
+	*errorp = sqrt(esqmax);
+	*drp = sqrt(drsqmax);
+	*spp = s1;
+}
+
+
+
+#ifndef CART_SINGLE
+
+/* Function to estimate the percentage completion.  Shared by both
+ * precisions */
+int cart_complete(double t)
+{
+	int res;
+	
+	res = 100*log(t/INITH)/log(EXPECTEDTIME/INITH);
+	if (res>100) res = 100;
+	
+	return res;
+}
+
+#endif
+
+
+
+/* Function to do the transformation of the given set of points
+ * to the cartogram.  If accurate is not set, the points are moved with
+ * cart_heunstep() instead of cart_twosteps().  The integration goes on
+ * until no point moves any more.  If refine is set, the remaining density
+ * differences are small: the time-step starts larger and may grow faster
+ * (the error control still applies), and the integration stops as soon 
+ * as the points hardly move */
+void cart_makecart(double *pointx, double *pointy, int npoints,
+				   int xsize, int ysize, double blur, int accurate, int refine)
+{
+	int i;
+	int s,sp;
+	int step;
+	int done;
+	double t,h;
+	double error,dr;
+	double desiredratio;
+	double maxratio;
+	double mindr;
+	
+	/* Calculate the initial density and velocity for snapshot zero */
+	
+	cart_density(0.0,0,xsize,ysize);
+	cart_vgrid(0,xsize,ysize);
+	s = 0;
+	
+	/* Now integrate the points in the polygons */
+	
+	step = 0;
+	t = 0.5*blur*blur;
+	h = refine ? REFINEH : INITH;
+	maxratio = refine ? REFINERATIO : MAXRATIO;
+	mindr = refine ? REFINEDR : 0.0;
+	
+	do {
+		
+		if (accurate) {
+			
+			/* Do a combined (triple) integration step */
+			
+			cart_twosteps(pointx,pointy,npoints,t,h,s,xsize,ysize,&error,&dr,&sp);
+			
+			/* Increase the time by 2h and rotate snapshots */
+			
+			t += 2.0*h;
+			step += 2;
+			s = sp;
+			
+			/* Adjust the time-step.  Factor of 2 arises because the target for
+			 * the two-step process is twice the target for an individual step */
+			
+			desiredratio = pow(2*TARGETERROR/error,0.2);
+			
+		} else {
+			
+			/* Do a single Heun step */
+			
+			cart_heunstep(pointx,pointy,npoints,t,h,s,xsize,ysize,&error,&dr,&sp);
+			
+			t += h;
+			step += 1;
+			s = sp;
+			
+			/* The error estimate is of second order in h */
+			
+			desiredratio = pow(TARGETERROR/error,0.5);
+		}
+		
+		if (desiredratio>maxratio) h *= maxratio;
+		else h *= desiredratio;
+		
+		done = cart_complete(t);
+#ifdef PERCENT
+		fprintf(stdout,"%i\n",done);
+#endif
+#ifndef NOPROGRESS
+		fprintf(stderr,"  %3i%%  |",done);
+		for (i=0; i<done/2; i++) fprintf(stderr,"=");
+		for (i=done/2; i<50; i++) fprintf(stderr," ");
+		fprintf(stderr,"|\r");
+#endif
+		
+		/* If no point moved then we are finished */
+		
+	} while (dr>mindr);
+	
+#ifdef PERCENT
+	fprintf(stdout,"\n");
+#endif
+#ifndef NOPROGRESS
+	fprintf(stderr,"  100%%  |==================================================|\n");
+#endif
+}
+
+
+
+/* Function to prepare the flow-based method of Gastner, Seguy & More
+ * (PNAS 115, E2156-E2164, 2018) for the density rho.  The density at time
+ * t is the linear interpolation (1-t)*rho + t*rhomean between the density
+ * and its mean, which is reached at t = 1.  The flux rho*v = -grad(phi)
+ * with -laplace(phi) = rho - rhomean satisfies the continuity equation and
+ * does not depend on t, so that it is computed only once.  Its Fourier
+ * series is back-transformed directly at the grid points (sine series
+ * along the derivative, cosine series along the other direction).  The
+ * flux and the density at the grid points are stored in flowgx, flowgy
+ * and flowrho (column-major, see GRID_IDX).  Returns the mean density */
+static double cart_flowsetup(real **rho, int xsize, int ysize)
+{
+	int ix,iy;
+	size_t npoints;
+	double kx,ky,phi,sum,norm;
+	double r00,r10,r01,r11;
+	real *in,*out;
+	fftw_plan plan;
+	
+	npoints = (size_t)(xsize+1)*(ysize+1);
+	flowgx = malloc(npoints*sizeof(real));
+	flowgy = malloc(npoints*sizeof(real));
+	flowrho = malloc(npoints*sizeof(real));
+	in = fftw_malloc(npoints*sizeof(real));
+	out = fftw_malloc(npoints*sizeof(real));
+	
+	/* Transform the density.  FFTW gives unnormalized transforms; the
+	 * normalization is needed here, as the velocity is not invariant to
+	 * the scale of the density */
+	
+	fftrho = fftw_malloc(xsize*ysize*sizeof(real));
+	cart_forward(*rho, xsize, ysize);
+	norm = 1.0 / (4.0*xsize*ysize);
+	
+	/* x-flux: sine series along x at ix = 1..xsize-1, cosine series along
+	 * y at iy = 0..ysize.  The output is the grid without its first and
+	 * last column, where the flux is zero */
+	
+	for (ix = 1; ix < xsize; ix++) {
+		kx = PI*ix/xsize;
+		for (iy = 0; iy < ysize; iy++) {
+			ky = PI*iy/ysize;
+			phi = norm * fftrho[ix*ysize+iy] / (kx*kx + ky*ky);
+			in[(ix-1)*(ysize+1)+iy] = kx*phi;
+		}
+		in[(ix-1)*(ysize+1)+ysize] = 0.0;
+	}
+	for (iy = 0; iy <= ysize; iy++) {
+		flowgx[GRID_IDX(0,iy,ysize)] = flowgx[GRID_IDX(xsize,iy,ysize)] = 0.0;
+	}
+	plan = fftw_plan_r2r_2d(xsize-1,ysize+1,in,flowgx+GRID_IDX(1,0,ysize),
+							FFTW_RODFT00,FFTW_REDFT00,FFTW_ESTIMATE);
+	fftw_execute(plan);
+	fftw_destroy_plan(plan);
+	
+	/* y-flux: cosine series along x at ix = 0..xsize, sine series along
+	 * y at iy = 1..ysize-1 */
+	
+	for (ix = 0; ix < xsize; ix++) {
+		kx = PI*ix/xsize;
+		for (iy = 1; iy < ysize; iy++) {
+			ky = PI*iy/ysize;
+			phi = norm * fftrho[ix*ysize+iy] / (kx*kx + ky*ky);
+			in[ix*(ysize-1)+iy-1] = ky*phi;
+		}
+	}
+	for (iy = 1; iy < ysize; iy++) in[xsize*(ysize-1)+iy-1] = 0.0;
+	plan = fftw_plan_r2r_2d(xsize+1,ysize-1,in,out,
+							FFTW_REDFT00,FFTW_RODFT00,FFTW_ESTIMATE);
+	fftw_execute(plan);
+	fftw_destroy_plan(plan);
+	for (ix = 0; ix <= xsize; ix++) {
+		flowgy[GRID_IDX(ix,0,ysize)] = flowgy[GRID_IDX(ix,ysize,ysize)] = 0.0;
+		for (iy = 1; iy < ysize; iy++) {
+			flowgy[GRID_IDX(ix,iy,ysize)] = out[ix*(ysize-1)+iy-1];
+		}
+	}
+	
+	fftw_free(in);
+	fftw_free(out);
+	fftw_free(fftrho);
+	
+	/* Density at the grid points, as the mean of the adjacent pixels, and
+	 * mean density */
+	
+	sum = 0.0;
+#pragma omp parallel for default(shared) private(ix, iy, r00, r10, r01, r11) reduction(+:sum)
+	for (ix = 0; ix <= xsize; ix++) {
+		for (iy = 0; iy <= ysize; iy++) {
+			r00 = rho[ix > 0 ? ix-1 : 0][iy > 0 ? iy-1 : 0];
+			r10 = rho[ix < xsize ? ix : xsize-1][iy > 0 ? iy-1 : 0];
+			r01 = rho[ix > 0 ? ix-1 : 0][iy < ysize ? iy : ysize-1];
+			r11 = rho[ix < xsize ? ix : xsize-1][iy < ysize ? iy : ysize-1];
+			flowrho[GRID_IDX(ix,iy,ysize)] = 0.25*(r00+r10+r01+r11);
+			if (ix < xsize && iy < ysize) sum += rho[ix][iy];
+		}
+	}
+	
+	return sum / ((double)xsize*ysize);
+}
+
+
+
+/* Function to calculate the velocity of the flow method at an arbitrary
+ * point and time t, by interpolating the velocities flux/density of the
+ * grid points.  Outside the boundaries, we extrapolate as in
+ * cart_velocity() */
+static void cart_flowvelocity(double rx, double ry, double t, int xsize, int ysize,
+							  double rhomean, double *vxp, double *vyp)
+{
+	int ix,iy;
+	size_t k00,k10,k01,k11;
+	double dx,dy;
+	double w00,w10,w01,w11;
+	double d00,d10,d01,d11;
+	
+	ix = rx;
+	if (ix<0) ix = 0;
+	else if (ix>=xsize) ix = xsize - 1;
+	
+	iy = ry;
+	if (iy<0) iy = 0;
+	else if (iy>=ysize) iy = ysize - 1;
+	
+	dx = rx - ix;
+	dy = ry - iy;
+	
+	w00 = (1-dx)*(1-dy);
+	w10 = dx*(1-dy);
+	w01 = (1-dx)*dy;
+	w11 = dx*dy;
+	
+	k00 = GRID_IDX(ix,iy,ysize);
+	k10 = k00 + ysize + 1;
+	k01 = k00 + 1;
+	k11 = k10 + 1;
+	
+	/* Density of the grid points at time t */
+	
+	d00 = (1-t)*flowrho[k00] + t*rhomean;
+	d10 = (1-t)*flowrho[k10] + t*rhomean;
+	d01 = (1-t)*flowrho[k01] + t*rhomean;
+	d11 = (1-t)*flowrho[k11] + t*rhomean;
+	
+	*vxp = w00*flowgx[k00]/d00 + w10*flowgx[k10]/d10 + w01*flowgx[k01]/d01 + w11*flowgx[k11]/d11;
+	*vyp = w00*flowgy[k00]/d00 + w10*flowgy[k10]/d10 + w01*flowgy[k01]/d01 + w11*flowgy[k11]/d11;
+}
+
+
+
+/* Function to integrate h time into the future with Heun's method, with
+ * the velocity of the flow method.  The parameters are the same as for
+ * cart_heunstep() */
+static void cart_flowstep(double *pointx, double *pointy, int npoints,
+						  double t, double h, int xsize, int ysize, double rhomean,
+						  double *errorp)
+{
+	int p;
+	double rx1,ry1;
+	double rx2,ry2;
+	double v1x,v1y;
+	double v2x,v2y;
+	double ex,ey;
+	double esq,esqmax,esqmax_t;
+	
+	esqmax = 0.0;
+	
+#pragma omp parallel default(shared) private(p, rx1, ry1, rx2, ry2, v1x, v1y, v2x, v2y, ex, ey, esq, esqmax_t)
+	{
+		esqmax_t = 0.0;
+		
+#pragma omp for schedule(static, CHUNK)
+		for (p = 0; p < npoints; p++) {
+			
+			rx1 = pointx[p];
+			ry1 = pointy[p];
+			
+			/* Euler predictor, then the trapezoidal corrector */
+			
+			cart_flowvelocity(rx1, ry1, t, xsize, ysize, rhomean, &v1x, &v1y);
+			cart_flowvelocity(rx1+h*v1x, ry1+h*v1y, t+h, xsize, ysize, rhomean, &v2x, &v2y);
+			
+			ex = 0.5*h*(v2x-v1x);
+			ey = 0.5*h*(v2y-v1y);
+			esq = ex*ex + ey*ey;
+			if (esq > esqmax_t) {
+				esqmax_t = esq;
+			}
+			
+			rx2 = rx1 + 0.5*h*(v1x+v2x);
+			ry2 = ry1 + 0.5*h*(v1y+v2y);
+			
+			if (rx2<0) rx2 = 0;
+			else if (rx2>xsize) rx2 = xsize;
+			if (ry2<0) ry2 = 0;
+			else if (ry2>ysize) ry2 = ysize;
+			
+			pointx[p] = rx2;
+			pointy[p] = ry2;
+		}
+		
+#pragma omp critical
+		{
+			if (esqmax_t > esqmax) esqmax = esqmax_t;
+		}
+	}
+	
+	*errorp = sqrt(esqmax);
+}
+
+
+
+/* Function to calculate the largest relative difference between the area
+ * of a cell of the displaced grid gridx, gridy and the area it should
+ * have according to the density rho */
+static double cart_areaerror(real **rho, double *gridx, double *gridy, int xsize, int ysize)
+{
+	int ix,iy;
+	size_t k00,k10,k01,k11;
+	double sum,area,target,err,errmax,errmax_t;
+	
+	sum = 0.0;
+	for (ix = 0; ix < xsize*ysize; ix++) sum += (*rho)[ix];
+	
+	errmax = 0.0;
+	
+#pragma omp parallel default(shared) private(ix, iy, k00, k10, k01, k11, area, target, err, errmax_t)
+	{
+		errmax_t = 0.0;
+		
+#pragma omp for
+		for (iy = 0; iy < ysize; iy++) {
+			for (ix = 0; ix < xsize; ix++) {
+				k00 = (size_t)iy*(xsize+1) + ix;
+				k10 = k00 + 1;
+				k01 = k00 + xsize + 1;
+				k11 = k01 + 1;
+				area = 0.5 * fabs((gridx[k11]-gridx[k00])*(gridy[k01]-gridy[k10]) - 
+								  (gridx[k01]-gridx[k10])*(gridy[k11]-gridy[k00]));
+				target = rho[ix][iy] * ((double)xsize*ysize) / sum;
+				err = fabs(area/target - 1.0);
+				if (err > errmax_t) errmax_t = err;
+			}
+		}
+		
+#pragma omp critical
+		{
+			if (errmax_t > errmax) errmax = errmax_t;
+		}
+	}
+	
+	return errmax;
+}
+
+
+
+/* Function to move the grid points gridx, gridy (row-major, see creategrid)
+ * to the cartogram of the density rho with the flow-based method.  The
+ * points are moved along the flow from t = 0 to 1.  As the interpolation
+ * of the velocity is not exact, the area of the cells is then compared
+ * to the density, and if the error is too large, the density in the space
+ * of the moved grid is computed (see cart_morphdensity) and the points are
+ * moved along its flow again, until the error does not decrease any
+ * more.  The grid with the smallest area error is kept.  Every iteration
+ * needs only three FFTs, and no FFT is needed during the integration.
+ * The grid points must be at their initial position, and rho is freed */
+void cart_flow(real **rho, double *gridx, double *gridy, int xsize, int ysize, int accurate)
+{
+	int iter,npoints;
+	double t,h,error,desiredratio,rhomean,areaerror,preverror,maxerror;
+	double *bestx,*besty;
+	real **frho;
+	
+	if (xsize < 2 || ysize < 2) {
+		fprintf(stderr, "Error. The flow method needs a raster of at least 2 x 2 pixels\n");
+		exit(1);
+	}
+	
+	npoints = (xsize+1)*(ysize+1);
+	maxerror = accurate ? FLOWAREAERROR : FLOWAREAERRORLA;
+	preverror = HUGE_VAL;
+	
+	/* Copy of the grid before the last iteration, restored if the
+	 * iteration made the area error larger */
+	
+	bestx = malloc(npoints*sizeof(double));
+	besty = malloc(npoints*sizeof(double));
+	if (bestx == NULL || besty == NULL) {
+		fprintf(stderr, "Error. Not enough memory for the flow method\n");
+		exit(1);
+	}
+	
+	for (iter = 0; iter < FLOWMAXITER; iter++) {
+		
+		if (iter > 0) {
+			memcpy(bestx, gridx, npoints*sizeof(double));
+			memcpy(besty, gridy, npoints*sizeof(double));
+		}
+		
+		/* Prepare the flow of the density that remains to be equalized */
+		
+		frho = (iter == 0) ? rho : cart_morphdensity(rho, gridx, gridy, xsize, ysize);
+		rhomean = cart_flowsetup(frho, xsize, ysize);
+		if (frho != rho) cart_dfree(frho);
+		
+		/* Integrate from t = 0 to 1 */
+		
+		t = 0.0;
+		h = FLOWINITH;
+		while (t < 1.0) {
+			if (t+h > 1.0) h = 1.0 - t;
+			cart_flowstep(gridx, gridy, npoints, t, h, xsize, ysize, rhomean, &error);
+			t += h;
+			desiredratio = pow(TARGETERROR/error, 0.5);
+			if (desiredratio>MAXRATIO) h *= MAXRATIO;
+			else h *= desiredratio;
+		}
+		
+		free(flowgx);
+		free(flowgy);
+		free(flowrho);
+		
+		areaerror = cart_areaerror(rho, gridx, gridy, xsize, ysize);
+#ifndef NOPROGRESS
+		fprintf(stderr, "  Iteration %i: max. area error %.2f%%\n", iter+1, 100*areaerror);
+#endif
+		
+		/* Stop when the error is small enough, or when it does not
+		 * decrease any more because of the discretization of the density */
+		
+		if (areaerror >= preverror) {
+			memcpy(gridx, bestx, npoints*sizeof(double));
+			memcpy(gridy, besty, npoints*sizeof(double));
+			break;
+		}
+		if (areaerror < maxerror) break;
+		preverror = areaerror;
+	}
+	
+	free(bestx);
+	free(besty);
+	cart_dfree(rho);
+}
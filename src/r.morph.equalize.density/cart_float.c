@@ -0,0 +1,8 @@
+/* 
+ * Single precision version of the cartogram code (functions cartf_*).
+ * See cart.c.
+ */
+
+#define CART_SINGLE
+
+#include "cart.c"
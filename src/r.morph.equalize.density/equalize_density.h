@@ -19,7 +19,48 @@
 
 
 
-int equalize_density(char *infile, char *outfile, int fast, int accurate);
+/* Index of grid point ix,iy in a column-major grid with ysize+1 rows.
+ * Used for the velocity grids.
+ */
+#define GRID_IDX(ix, iy, ysize)	((size_t)(ix) * ((ysize)+1) + (iy))
+
+
+
+/* Binary morphing grid format; see proj.h in r.morph.transform for the
+ * description of the file layout.
+ */
+#define MORPH_BINARY_MAGIC "STMGRID1"
+#define MORPH_BINARY_HEADER_SIZE 64
+
+
+
+/* Computes the morphing grid for the density raster infile and writes it
+ * to outfile. If wisdom is not NULL, it is a directory in which the FFTW
+ * wisdom is cached for every grid size. With more than one level, the
+ * cartogram is computed coarse to fine (see cart_multires). If single is
+ * set, the cartogram is computed in single precision (see cart.c); if
+ * compare is set as well, it is also computed in double precision, and the
+ * difference between the two grids is reported. If flow is set, the
+ * flow-based method is used instead of the diffusion method (see
+ * cart_flow); fast, wisdom and levels do not apply then.
+ */
+int equalize_density(char *infile, char *outfile, int fast, int accurate, int binary, 
+					 char *wisdom, int levels, int single, int compare, int flow);
+
+
+
+
+/* Computes the cartogram for the density raster infile, moving only the
+ * vertices of a vector layer instead of a morphing grid. The input layer
+ * (or the first layer if input_layer is NULL) of vectorfile is written with
+ * the moved vertices to the layer output_layer of outfile. If format is
+ * NULL, the output has the format of the input. Vertices outside the
+ * raster are not moved. The other parameters are the same as for
+ * equalize_density.
+ */
+int equalize_vector(char *infile, char *vectorfile, char *input_layer, char *outfile, 
+					char *format, char *output_layer, int fast, int accurate, 
+					char *wisdom, int levels, int single);
 
 
 
@@ -39,14 +80,54 @@ void writepoints(FILE *fp, double *gridx, double *gridy, int xsize, int ysize,
 				 double *adfGeoTransform);
 
 
+// Writes the morphing grid out into a binary file.
+void writepoints_binary(FILE *fp, double *gridx, double *gridy, int xsize, int ysize, 
+						double *adfGeoTransform);
 
 
-double** cart_dmalloc(int xsize, int ysize);
-void cart_dfree(double **userrho);
-void cart_makews(int xsize, int ysize);
-void cart_freews(int xsize, int ysize);
-void cart_transform(double **userrho, int xsize, int ysize);
-void cart_makecart(double *pointx, double *pointy, int npoints, int xsize, int ysize, double blur);
 
+// Reports the difference between the grid gridx, gridy and the reference
+// grid refx, refy (in pixels).
+void comparepoints(double *gridx, double *gridy, double *refx, double *refy, int npoints);
 
 
+
+
+// Cartogram code in double precision (see cart.c)
+double** cart_dmalloc(int xsize, int ysize);
+void cart_dfree(double **userrho);
+void cart_makews(int xsize, int ysize, int fast, int accurate);
+void cart_freews(void);
+void cart_transform(double **userrho, int xsize, int ysize);
+void cart_makecart(double *pointx, double *pointy, int npoints, int xsize, int ysize, double blur, 
+				   int accurate, int refine);
+void cart_solve(double **rho, double *gridx, double *gridy, int xsize, int ysize,
+				int fast, int accurate, char *wisdom, int refine);
+void cart_solvepoints(double **rho, double *pointx, double *pointy, int npoints, 
+					  int xsize, int ysize, int fast, int accurate, char *wisdom, int refine);
+double** cart_downsample(double **rho, int xsize, int ysize, int lx, int ly);
+void cart_upsample(double *pgx, double *pgy, int plx, int ply,
+				   double *gx, double *gy, int lx, int ly);
+void cart_movepoints(double *pgx, double *pgy, int plx, int ply,
+					 double *pointx, double *pointy, int npoints, int xsize, int ysize);
+double** cart_morphdensity(double **rho, double *gx, double *gy, int xsize, int ysize);
+void cart_multires(double **rho, double *gridx, double *gridy, int xsize, int ysize, 
+				   int levels, int fast, int accurate, char *wisdom);
+void cart_multirespoints(double **rho, double *pointx, double *pointy, int npoints,
+						 int xsize, int ysize, int levels, int fast, int accurate, char *wisdom);
+void cart_flow(double **rho, double *gridx, double *gridy, int xsize, int ysize, int accurate);
+
+
+// Single precision versions of the above (see cart_float.c). Only the
+// arrays differ; the grid points are always in double precision.
+float** cartf_dmalloc(int xsize, int ysize);
+void cartf_dfree(float **userrho);
+void cartf_solve(float **rho, double *gridx, double *gridy, int xsize, int ysize,
+				 int fast, int accurate, char *wisdom, int refine);
+void cartf_solvepoints(float **rho, double *pointx, double *pointy, int npoints, 
+					   int xsize, int ysize, int fast, int accurate, char *wisdom, int refine);
+void cartf_multires(float **rho, double *gridx, double *gridy, int xsize, int ysize, 
+					int levels, int fast, int accurate, char *wisdom);
+void cartf_multirespoints(float **rho, double *pointx, double *pointy, int npoints,
+						  int xsize, int ysize, int levels, int fast, int accurate, char *wisdom);
+void cartf_flow(float **rho, double *gridx, double *gridy, int xsize, int ysize, int accurate);
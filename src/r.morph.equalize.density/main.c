@@ -6,7 +6,9 @@
  
  Syntax:
  r.morph.equalize.density --input inraster --output morphfile 
- [--slower] [--less_accurate]
+ [--slower] [--less_accurate] [--binary] [--wisdom dir] [--levels n]
+ [--single] [--compare] [--engine diffusion|flow]
+ [--vector datasource [--input_layer layer] [--output_layer layer] [--format fmt]]
  
  Author:	Christian Kaiser, chri.kais@gmail.com
  
@@ -17,6 +19,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 
 #include <GDAL/gdal.h>
@@ -35,7 +38,11 @@ static char *usage[] = {
 	"   SYNOPSIS\n",
 	"      r.morph.equalize.density [--help] --input input_raster\n",
 	"         --output output_morph_file\n",
-	"         [--slower] [--less_accurate]\n",
+	"         [--slower] [--less_accurate] [--binary]\n",
+	"         [--wisdom directory] [--levels n] [--single] [--compare]\n",
+	"         [--engine diffusion|flow]\n",
+	"         [--vector vector_datasource [--input_layer layer_name]\n",
+	"         [--output_layer layer_name] [--format ogr_format]]\n",
 	"   DESCRIPTION\n",
 	"      The following options are available:\n",
 	"         --help           Shows this usage note.\n",
@@ -49,6 +56,42 @@ static char *usage[] = {
 	"                          requirement is about 40% less with the fast\n",
 	"                          algorithm, and 70% less with the slow\n",
 	"                          algorithm.\n",
+	"         --binary         Writes the morph file in the binary format, which\n",
+	"                          is much smaller and faster to read than the text\n",
+	"                          format.\n",
+	"         --wisdom         Directory in which the FFT plans are saved for\n",
+	"                          every grid size. The next run on a grid of the\n",
+	"                          same size reuses the saved plans, which saves\n",
+	"                          the planning time.\n",
+	"         --levels         Number of resolution levels. With more than one\n",
+	"                          level, the cartogram is first computed on a grid\n",
+	"                          2^(levels-1) times coarser, and then refined at\n",
+	"                          every finer level. Much faster on large rasters.\n",
+	"                          Default is 1.\n",
+	"         --single         Computes the cartogram in single precision, which\n",
+	"                          needs about half the memory and is faster. The\n",
+	"                          morph file is written in double precision.\n",
+	"         --compare        With --single, computes the cartogram also in\n",
+	"                          double precision and reports the displacement\n",
+	"                          error of the single precision grid. The morph\n",
+	"                          file is the single precision one.\n",
+	"         --engine         The cartogram method. 'diffusion' is the method of\n",
+	"                          Gastner & Newman (default). 'flow' is the flow-\n",
+	"                          based method of Gastner, Seguy & More, which needs\n",
+	"                          far fewer FFTs and is usually much faster. With\n",
+	"                          'flow', --slower, --wisdom and --levels have no\n",
+	"                          effect, and --less_accurate allows a larger area\n",
+	"                          error.\n",
+	"         --vector         Moves only the vertices of a layer in this OGR\n",
+	"                          datasource, and writes the transformed layer to\n",
+	"                          the output datasource instead of a morph file.\n",
+	"                          Much faster if only one layer is needed.\n",
+	"                          Vertices outside the raster are not moved.\n",
+	"         --input_layer    The layer to transform. Default is the first one.\n",
+	"         --output_layer   The name of the output layer. Default is\n",
+	"                          'transformed_layer'.\n",
+	"         --format         The OGR format of the output datasource. Default\n",
+	"                          is the format of the input.\n",
 	"   BUGS\n",
 	"      Please send any comments or bug reports to chri.kais@gmail.com.\n",
 	"   VERSION\n",
@@ -63,6 +106,10 @@ static char *usage[] = {
 	"      producing density equalizing maps' (Proc. Natl. Acad. Sci. USA 101,\n",
 	"      7499-7504, 2004). See http://www-personal.umich.edu/~mejn/cart/ for\n",
 	"      more details.\n",
+	"      The flow-based method is described in 'Fast flow-based algorithm\n",
+	"      for creating density-equalizing map projections' by Michael\n",
+	"      Gastner, Vivien Seguy and Pratyush More (Proc. Natl. Acad. Sci. USA\n",
+	"      115, E2156-E2164, 2018).\n",
 	"\n",
 	NULL};
 
@@ -75,8 +122,8 @@ int main (int argc, const char *argv[]) {
 	int c;
 	int ok;
 	
-	char *infile, *outfile;
-	int fast, accurate;
+	char *infile, *outfile, *wisdom, *vectorfile, *input_layer, *output_layer, *format;
+	int fast, accurate, binary, levels, single, compare, flow;
 	
 	extern int optind;
 	extern int optopt;
@@ -90,8 +137,12 @@ int main (int argc, const char *argv[]) {
 	
 	
 	// Provide default values.
-	infile = outfile = NULL;
+	infile = outfile = wisdom = NULL;
+	vectorfile = input_layer = format = NULL;
+	output_layer = "transformed_layer";
 	fast = accurate = 1;
+	binary = single = compare = flow = 0;
+	levels = 1;
 	
 	
 	// Process command line
@@ -103,10 +154,20 @@ int main (int argc, const char *argv[]) {
 			{"output",			required_argument,	0,	'o'},
 			{"slower",			no_argument,		0,	's'},
 			{"less_accurate",	no_argument,		0,	'l'},
+			{"binary",			no_argument,		0,	'b'},
+			{"wisdom",			required_argument,	0,	'w'},
+			{"levels",			required_argument,	0,	'n'},
+			{"single",			no_argument,		0,	'f'},
+			{"compare",			no_argument,		0,	'c'},
+			{"vector",			required_argument,	0,	'v'},
+			{"input_layer",		required_argument,	0,	'1'},
+			{"output_layer",	required_argument,	0,	'2'},
+			{"format",			required_argument,	0,	'3'},
+			{"engine",			required_argument,	0,	'e'},
 			{0, 0, 0, 0}
 		};
 		
-		c = getopt_long(argc, (char**)argv, "hi:o:sl", long_options, NULL);
+		c = getopt_long(argc, (char**)argv, "hi:o:slbw:n:fcv:1:2:3:e:", long_options, NULL);
 		if (c == -1) {
 			break;
 		}
@@ -127,6 +188,43 @@ int main (int argc, const char *argv[]) {
 			case 'l':
 				accurate = 0;
 				break;
+			case 'b':
+				binary = 1;
+				break;
+			case 'w':
+				wisdom = optarg;
+				break;
+			case 'n':
+				levels = atoi(optarg);
+				break;
+			case 'f':
+				single = 1;
+				break;
+			case 'c':
+				compare = 1;
+				break;
+			case 'v':
+				vectorfile = optarg;
+				break;
+			case '1':
+				input_layer = optarg;
+				break;
+			case '2':
+				output_layer = optarg;
+				break;
+			case '3':
+				format = optarg;
+				break;
+			case 'e':
+				if (strcmp(optarg, "flow") == 0) {
+					flow = 1;
+				} else if (strcmp(optarg, "diffusion") == 0) {
+					flow = 0;
+				} else {
+					fprintf(stderr, "Error. Unknown engine `%s'.\n", optarg);
+					exit(1);
+				}
+				break;
 			case '?':
 				return 1;
 			default:
@@ -145,10 +243,28 @@ int main (int argc, const char *argv[]) {
 		fprintf(stderr, "Error. You must supply a path to an output morph file.\n");
 		exit(1);
 	}
+	if (vectorfile != NULL && (binary || compare)) {
+		fprintf(stderr, "Error. --binary and --compare can not be used with --vector.\n");
+		exit(1);
+	}
+	if (flow && vectorfile != NULL) {
+		fprintf(stderr, "Error. The flow engine can not be used with --vector.\n");
+		exit(1);
+	}
+	if (compare && !single) {
+		fprintf(stderr, "Error. --compare can only be used with --single.\n");
+		exit(1);
+	}
 	
 	
 	printf("r.morph.equalize.density starting\n");
-	ok = equalize_density(infile, outfile, fast, accurate);
+	if (vectorfile != NULL) {
+		ok = equalize_vector(infile, vectorfile, input_layer, outfile, format, output_layer,
+							 fast, accurate, wisdom, levels, single);
+	} else {
+		ok = equalize_density(infile, outfile, fast, accurate, binary, wisdom, levels, 
+							  single, compare, flow);
+	}
 	printf("r.morph.equalize.density done\n");
 	
 	return ok;
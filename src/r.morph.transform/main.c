@@ -15,6 +15,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 
 #include "transform.h"
@@ -34,7 +35,9 @@ static char *usage[] = {
 	"         --input INPUT_DATASOURCE [--input_layer INPUT_LAYER]\n",
 	"         --morphfile MORPH_FILE\n",
 	"         --output OUTPUT_DATASOURCE [--output_layer OUTPUT_LAYER]\n",
-	"         [--raster] [--format FORMAT]\n",
+	"         [--raster] [--resampling METHOD] [--format FORMAT] [--binary]\n",
+	"      r.morph.transform --invert --morphfile MORPH_FILE --output MORPH_FILE\n",
+	"         [--refine FACTOR] [--binary]\n",
 	"   DESCRIPTION\n",
 	"      The following options are available:\n",
 	"         --help            Shows this usage note.\n",
@@ -56,7 +59,26 @@ static char *usage[] = {
 	"                           vector layer. If not given, all attributes will be\n",
 	"                           kept, if empty, none.\n",
 	"         --raster          Working in raster mode instead of vector mode.\n",
+	"         --resampling      Resampling method in raster mode, either 'nearest'\n",
+	"                           (default) or 'bilinear'.\n",
 	"         --back            Make a back transform instead of forward transform.\n",
+	"         --binary          Without input and output files, coordinates are read\n",
+	"                           from standard input and written to standard output\n",
+	"                           as text lines, one coordinate pair per line. Lines\n",
+	"                           without a valid pair, including blank lines, are\n",
+	"                           written as 'nan nan', so that every input line has\n",
+	"                           its output line. With this option, they are read and\n",
+	"                           written as pairs of little-endian 64-bit floating\n",
+	"                           point numbers instead.\n",
+	"         --invert          Computes the inverse of the morph file and writes it\n",
+	"                           to the output file. Transforming with the inverse\n",
+	"                           morph file is the same as making a back transform\n",
+	"                           with the original one, but much faster. With\n",
+	"                           --binary, the inverse morph file is written in the\n",
+	"                           binary format.\n",
+	"         --refine          Number of cells of the inverse morph file for every\n",
+	"                           cell of the original one, in each direction.\n",
+	"                           Default is 1.\n",
 	"         --format          The format of the output layer.\n",
 	"                           By default, it is the same as the input layer.\n",
 	"                           Alternatively, it can be one of the following for\n",
@@ -100,7 +122,7 @@ int main (int argc, const char *argv[]) {
 	
 	char *infile, *morphfile, *outfile, *format, *input_layer, *output_layer;
 	char *attrs, *spatial_filter, *attr_filter;
-	int raster, back_transform;
+	int raster, back_transform, bilinear, binary, invert, refine;
 	
 	extern int optind;
 	extern int optopt;
@@ -120,6 +142,10 @@ int main (int argc, const char *argv[]) {
 	raster = 0;
 	output_layer = "transformed_layer";
 	back_transform = 0;
+	bilinear = 0;
+	binary = 0;
+	invert = 0;
+	refine = 1;
 	
 	
 	// Process command line
@@ -138,10 +164,14 @@ int main (int argc, const char *argv[]) {
 			{"output_layer",	required_argument,  0,  '2'},
 			{"attrs",			required_argument,	0,	'a'},
 			{"back",			no_argument,		0,	'b'},
+			{"resampling",		required_argument,	0,	'3'},
+			{"binary",			no_argument,		0,	'4'},
+			{"invert",			no_argument,		0,	'5'},
+			{"refine",			required_argument,	0,	'6'},
 			{0, 0, 0, 0}
 		};
 		
-		c = getopt_long(argc, (char**)argv, "hi:m:o:f:r1:s:w:a:2:b", long_options, NULL);
+		c = getopt_long(argc, (char**)argv, "hi:m:o:f:r1:s:w:a:2:b3:456:", long_options, NULL);
 		if (c == -1) {
 			break;
 		}
@@ -183,6 +213,25 @@ int main (int argc, const char *argv[]) {
 			case 'b':
 				back_transform = 1;
 				break;
+			case '3':
+				if (strcmp(optarg, "bilinear") == 0) {
+					bilinear = 1;
+				} else if (strcmp(optarg, "nearest") == 0) {
+					bilinear = 0;
+				} else {
+					fprintf(stderr, "Error. Unknown resampling method '%s'.\n", optarg);
+					exit(1);
+				}
+				break;
+			case '4':
+				binary = 1;
+				break;
+			case '5':
+				invert = 1;
+				break;
+			case '6':
+				refine = atoi(optarg);
+				break;
 			case '?':
 				return 1;
 			default:
@@ -197,6 +246,17 @@ int main (int argc, const char *argv[]) {
 		fprintf(stderr, "Error. You must supply a morph file.\n");
 		exit(1);
 	}
+	
+	// Compute the inverse morph file.
+	if (invert) {
+		if (outfile == NULL) {
+			fprintf(stderr, "Error. Specify an output morph file.\n");
+			exit(1);
+		}
+		ok = invert_transform(morphfile, outfile, refine, binary);
+		return ok;
+	}
+	
 	if ((infile == NULL && outfile != NULL) || (infile != NULL && outfile == NULL)) {
 		fprintf(stderr, "Error. Specify an input and an output file.\n");
 		exit(1);
@@ -209,7 +269,7 @@ int main (int argc, const char *argv[]) {
 	// If input and output files are not given, read the coordinates from standard input and
 	// write the transformed values to the standard output.
 	if (infile == NULL && outfile == NULL) {
-		ok = coord_transform(morphfile, back_transform);
+		ok = coord_transform(morphfile, back_transform, binary);
 		return ok;
 	}
 	
@@ -217,7 +277,7 @@ int main (int argc, const char *argv[]) {
 	
 	// We have input and output files. Choose between raster and vector.
 	if (raster) {
-		ok = raster_transform(infile, morphfile, outfile, format, back_transform);
+		ok = raster_transform(infile, morphfile, outfile, format, back_transform, bilinear);
 	} else {
 		ok = vector_transform(infile, input_layer, spatial_filter, attr_filter, 
 							  morphfile, 
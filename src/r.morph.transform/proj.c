@@ -18,13 +18,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "proj.h"
 
 
 #define LINELENGTH 1000
 
+#define MAXWALK 64		// Maximum number of cells visited by grid_cell_walk
+
 #ifndef MAX
 #  define MIN(a,b)      ((a<b) ? a : b)
 #  define MAX(a,b)      ((a>b) ? a : b)
@@ -36,7 +43,7 @@
 morph *create_morph(int xsize, int ysize)
 {
 	morph *mg;
-	int i;
+	size_t npoints;
 	
 	
 	if (xsize <= 0 || ysize <= 0) {
@@ -48,22 +55,18 @@ morph *create_morph(int xsize, int ysize)
 	
 	mg->xsize = xsize;
 	mg->ysize = ysize;
-	
-	mg->x = malloc((xsize+1)*sizeof(double*));
-	mg->y = malloc((xsize+1)*sizeof(double*));
-	if (mg->x == NULL || mg->y == NULL) {
+	mg->map = NULL;
+	mg->map_size = 0;
+	mg->index = NULL;
+	
+	// One single buffer for the x and the y coordinates.
+	npoints = (size_t)(xsize+1) * (ysize+1);
+	mg->x = malloc(2*npoints*sizeof(double));
+	if (mg->x == NULL) {
 		fprintf(stderr, "[ScapeToadPy] Error. Unable to allocate memory for morphing grid.\n");
 		return NULL;
 	}
-	
-	for (i = 0; i <= xsize; i++) {
-		mg->x[i] = malloc((ysize+1)*sizeof(double));
-		mg->y[i] = malloc((ysize+1)*sizeof(double));
-		if (mg->x[i] == NULL || mg->y[i] == NULL) {
-			fprintf(stderr, "[ScapeToadPy] Error. Unable to allocate memory for morphing grid.\n");
-			return NULL;
-		}
-	}
+	mg->y = mg->x + npoints;
 	
 	return mg;
 }
@@ -73,15 +76,17 @@ morph *create_morph(int xsize, int ysize)
 
 void free_morph(morph* mg)
 {
-	int i;
-	
-	for (i = 0; i <= mg->xsize; i++) {
-		free(mg->x[i]);
-		free(mg->y[i]);
+	if (mg->index != NULL) {
+		free(mg->index->start);
+		free(mg->index->cells);
+		free(mg->index);
 	}
 	
-	free(mg->x);
-	free(mg->y);
+	if (mg->map != NULL) {
+		munmap(mg->map, mg->map_size);
+	} else {
+		free(mg->x);
+	}
 	
 	free(mg);
 }
@@ -143,27 +148,23 @@ int point_pixel_to_geo (double pixelx, double pixely, double *geox, double *geoy
 
 
 int read_grid_points (FILE *stream, 
-					  double **gridx, double **gridy, 
+					  double *gridx, double *gridy, 
 					  int xsize, int ysize)
 {
 
 	int ix, iy;
+	size_t idx;
 
+	// The text file is in row-major order.
 	for (iy = 0; iy <= ysize; iy++) {
 		for (ix = 0; ix <= xsize; ix++) {
-			if (fscanf(stream,"%lf %lf\n", &gridx[ix][iy], &gridy[ix][iy]) < 2) {
+			idx = GRID_IDX(ix, iy, ysize);
+			if (fscanf(stream,"%lf %lf\n", &gridx[idx], &gridy[idx]) < 2) {
 				return 1;
 			}
 		}
 	}
 
-	/*int i;
-	for (i = 0; i < (xsize+1)*(ysize+1); i++) {
-		if (fscanf(stream,"%lf %lf\n", gridx[i], gridy[i]) < 2) {
-			return 1;
-		}
-	}*/
-
 	return 0;
 	
 }
@@ -202,6 +203,123 @@ int read_grid_georef (FILE *stream, double *geoTransform)
 
 
 
+morph* read_grid_binary (char *file)
+{
+	int fd;
+	struct stat st;
+	char *map;
+	int xsize, ysize;
+	size_t npoints, size;
+	morph *mg;
+	
+	
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr,"[ScapeToadPy] Uunable to open morphing grid file `%s'\n", file);
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < MORPH_BINARY_HEADER_SIZE) {
+		fprintf(stderr, "Error. Binary morphing grid file `%s' is too short.\n", file);
+		close(fd);
+		return NULL;
+	}
+	
+	// Map the whole file. The mapping stays valid after closing the file.
+	size = (size_t)st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Error. Unable to map morphing grid file `%s'.\n", file);
+		return NULL;
+	}
+	
+	// Check the header.
+	memcpy(&xsize, map + 8, sizeof(int));
+	memcpy(&ysize, map + 12, sizeof(int));
+	if (memcmp(map, MORPH_BINARY_MAGIC, 8) != 0 || xsize <= 0 || ysize <= 0) {
+		fprintf(stderr, "Error. Morphing grid size invalid.\n");
+		munmap(map, size);
+		return NULL;
+	}
+	npoints = (size_t)(xsize+1) * (ysize+1);
+	if (size < MORPH_BINARY_HEADER_SIZE + 2*npoints*sizeof(double)) {
+		fprintf(stderr, "Error. Unable to read the morphing grid points.\n");
+		munmap(map, size);
+		return NULL;
+	}
+	
+	mg = malloc(sizeof(morph));
+	mg->xsize = xsize;
+	mg->ysize = ysize;
+	memcpy(mg->georef, map + 16, 6*sizeof(double));
+	mg->map = map;
+	mg->map_size = size;
+	mg->index = NULL;
+	
+	// The grid points are used directly from the mapped file.
+	mg->x = (double*)(map + MORPH_BINARY_HEADER_SIZE);
+	mg->y = mg->x + npoints;
+	
+	return mg;
+}
+
+
+
+
+
+int write_grid (char *file, morph *mg, int binary)
+{
+	FILE *fp;
+	char header[MORPH_BINARY_HEADER_SIZE];
+	int ix, iy;
+	
+	
+	fp = fopen(file, binary ? "wb" : "w");
+	if (fp == NULL) {
+		fprintf(stderr,"Error. Unable to open file `%s'\n", file);
+		return 1;
+	}
+	
+	if (binary) {
+		memset(header, 0, MORPH_BINARY_HEADER_SIZE);
+		memcpy(header, MORPH_BINARY_MAGIC, 8);
+		memcpy(header + 8, &mg->xsize, sizeof(int));
+		memcpy(header + 12, &mg->ysize, sizeof(int));
+		memcpy(header + 16, mg->georef, 6*sizeof(double));
+		fwrite(header, 1, MORPH_BINARY_HEADER_SIZE, fp);
+		fwrite(mg->x, sizeof(double), (size_t)(mg->xsize+1) * (mg->ysize+1), fp);
+		fwrite(mg->y, sizeof(double), (size_t)(mg->xsize+1) * (mg->ysize+1), fp);
+	} else {
+		fprintf(fp, "ScapeToad morphing grid file version 1.0\n");
+		fprintf(fp, "xsize: %i\n", mg->xsize);
+		fprintf(fp, "ysize: %i\n", mg->ysize);
+		fprintf(fp, "topleftx: %f\n", mg->georef[0]);
+		fprintf(fp, "weres: %f\n", mg->georef[1]);
+		fprintf(fp, "rot1: %f\n", mg->georef[2]);
+		fprintf(fp, "toplefty: %f\n", mg->georef[3]);
+		fprintf(fp, "rot2: %f\n", mg->georef[4]);
+		fprintf(fp, "nsres: %f\n", mg->georef[5]);
+		for (iy = 0; iy <= mg->ysize; iy++) {
+			for (ix = 0; ix <= mg->xsize; ix++) {
+				fprintf(fp, "%f %f\n", MORPH_X(mg, ix, iy), MORPH_Y(mg, ix, iy));
+			}
+		}
+	}
+	
+	if (ferror(fp)) {
+		fprintf(stderr, "Error. Unable to write morphing grid file `%s'\n", file);
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+	
+	return 0;
+}
+
+
+
+
+
 morph* read_grid (char *file)
 {
 	FILE *fp;
@@ -219,6 +337,13 @@ morph* read_grid (char *file)
 		return NULL;
 	}
 	
+	// Binary grid files are mapped into memory.
+	if (fread(line, 1, 8, fp) == 8 && memcmp(line, MORPH_BINARY_MAGIC, 8) == 0) {
+		fclose(fp);
+		return read_grid_binary(file);
+	}
+	rewind(fp);
+	
 	
 	// Read the morphing grid size.
 	l = fgets(line, 10240, fp);			// File version information
@@ -269,11 +394,12 @@ morph* read_grid (char *file)
 
 int project_coord (double xgeo, double ygeo, 
 				   double *xout, double *yout,
-				   double **gridx, double **gridy, int xsize, int ysize,
+				   double *gridx, double *gridy, int xsize, int ysize,
 				   double geoTransform[6])
 {
 	
 	int ix,iy;
+	size_t k0, k1;			// Index of the grid points ix,iy and ix+1,iy
 	double xin,yin;			// Grid coordinates
 	double dx, dy, x, y;
 	double topleftx, toplefty, weres, nsres, rot1, rot2;	// Georeference
@@ -308,8 +434,10 @@ int project_coord (double xgeo, double ygeo,
 		dx = xin - ix;
 		iy = yin;
 		dy = yin - iy;
-		x = (1-dx)*(1-dy)*gridx[ix][iy] + dx*(1-dy)*gridx[ix+1][iy] + (1-dx)*dy*gridx[ix][iy+1] + dx*dy*gridx[ix+1][iy+1];
-		y = (1-dx)*(1-dy)*gridy[ix][iy] + dx*(1-dy)*gridy[ix+1][iy] + (1-dx)*dy*gridy[ix][iy+1] + dx*dy*gridy[ix+1][iy+1];
+		k0 = GRID_IDX(ix, iy, ysize);
+		k1 = k0 + ysize + 1;
+		x = (1-dx)*(1-dy)*gridx[k0] + dx*(1-dy)*gridx[k1] + (1-dx)*dy*gridx[k0+1] + dx*dy*gridx[k1+1];
+		y = (1-dx)*(1-dy)*gridy[k0] + dx*(1-dy)*gridy[k1] + (1-dx)*dy*gridy[k0+1] + dx*dy*gridy[k1+1];
 		
 		// Transform back to geographic coordinates
 		ok = point_pixel_to_geo(x, y, xout, yout, geoTransform);
@@ -328,12 +456,184 @@ int project_coord (double xgeo, double ygeo,
 
 
 
+int project_coord_array (double *x, double *y, int n, morph *grid)
+{
+	
+	int i, ix, iy, xsize, ysize;
+	size_t k0, k1;
+	double topleftx, toplefty, weres, nsres, rot1, rot2;	// Georeference
+	double den_x, den_y, xin, yin, dx, dy, gx, gy;
+	double *gridx, *gridy;
+	
+	
+	topleftx = grid->georef[0];
+	weres = grid->georef[1];
+	rot1 = grid->georef[2];
+	toplefty = grid->georef[3];
+	rot2 = grid->georef[4];
+	nsres = grid->georef[5];
+	if (nsres*weres == 0) {
+		return 1;
+	}
+	den_x = rot1*rot2 - nsres*weres;
+	den_y = weres*nsres - rot1*rot2;
+	
+	xsize = grid->xsize;
+	ysize = grid->ysize;
+	gridx = grid->x;
+	gridy = grid->y;
+	
+	for (i = 0; i < n; i++) {
+		
+		// Transform the point from geographic coordinates to the grid space
+		// (same as point_geo_to_pixel).
+		xin = (y[i]*rot1 - toplefty*rot1 - x[i]*nsres + topleftx*nsres) / den_x;
+		yin = (y[i]*weres - toplefty*weres - x[i]*rot2 + topleftx*rot2) / den_y;
+		
+		// Points outside the grid are not changed.
+		if ((xin < 0.0) || (xin >= xsize) || (yin < 0.0) || (yin >= ysize)) {
+			continue;
+		}
+		
+		// Bilinear interpolation
+		ix = xin;
+		dx = xin - ix;
+		iy = yin;
+		dy = yin - iy;
+		k0 = GRID_IDX(ix, iy, ysize);
+		k1 = k0 + ysize + 1;
+		gx = (1-dx)*(1-dy)*gridx[k0] + dx*(1-dy)*gridx[k1] + (1-dx)*dy*gridx[k0+1] + dx*dy*gridx[k1+1];
+		gy = (1-dx)*(1-dy)*gridy[k0] + dx*(1-dy)*gridy[k1] + (1-dx)*dy*gridy[k0+1] + dx*dy*gridy[k1+1];
+		
+		// Transform back to geographic coordinates
+		x[i] = topleftx + gx*weres + gy*rot1;
+		y[i] = toplefty + gx*rot2 + gy*nsres;
+	}
+	
+	return 0;
+}
+
+
+
+
+
+
 int project_back_coord (double xembedded, double yembedded, double *xorig, double *yorig, morph *grid) {
 	
-	double i, j, i1, i2, j1, j2;
+	int cellx, celly;
+	
+	cellx = celly = -1;
+	return project_back_coord_walk(xembedded, yembedded, xorig, yorig, grid, &cellx, &celly);
+}
+
+
+
+
+
+/*
+ * Inverts the bilinear interpolation inside the morphed cell cellx,celly
+ * with Newton's method. px,py is the point in the embedded grid space,
+ * and i,j receive its position inside the original cell (between 0 and 1).
+ * Returns 0 if successful, 1 if the iteration did not converge.
+ */
+static int invert_bilinear (double px, double py, morph *grid, int cellx, int celly, 
+							double *i, double *j) {
+	
+	double ax, ay, bx, by, cx, cy, dx, dy;
+	double fx, fy, xi, yi, xj, yj, det, di, dj, u, v;
+	int iter;
+	
+	
+	ax = MORPH_X(grid, cellx, celly);
+	ay = MORPH_Y(grid, cellx, celly);
+	bx = MORPH_X(grid, cellx+1, celly);
+	by = MORPH_Y(grid, cellx+1, celly);
+	cx = MORPH_X(grid, cellx+1, celly+1);
+	cy = MORPH_Y(grid, cellx+1, celly+1);
+	dx = MORPH_X(grid, cellx, celly+1);
+	dy = MORPH_Y(grid, cellx, celly+1);
+	
+	// The interpolated point is
+	//		P(u,v) = a(1-u)(1-v) + b u(1-v) + c u v + d (1-u) v
+	// Start at the centre of the cell.
+	u = v = 0.5;
+	for (iter = 0; iter < 20; iter++) {
+		fx = ax*(1-u)*(1-v) + bx*u*(1-v) + cx*u*v + dx*(1-u)*v - px;
+		fy = ay*(1-u)*(1-v) + by*u*(1-v) + cy*u*v + dy*(1-u)*v - py;
+		xi = (bx-ax)*(1-v) + (cx-dx)*v;
+		yi = (by-ay)*(1-v) + (cy-dy)*v;
+		xj = (dx-ax)*(1-u) + (cx-bx)*u;
+		yj = (dy-ay)*(1-u) + (cy-by)*u;
+		det = xi*yj - xj*yi;
+		if (det == 0) {
+			return 1;
+		}
+		di = (fx*yj - fy*xj) / det;
+		dj = (fy*xi - fx*yi) / det;
+		u -= di;
+		v -= dj;
+		if (fabs(di) < 1e-12 && fabs(dj) < 1e-12) {
+			break;
+		}
+	}
+	if (iter == 20 || u < -1e-6 || u > 1+1e-6 || v < -1e-6 || v > 1+1e-6) {
+		return 1;
+	}
+	
+	*i = MIN(MAX(u, 0.0), 1.0);
+	*j = MIN(MAX(v, 0.0), 1.0);
+	
+	return 0;
+}
+
+
+
+
+/*
+ * Projects a point from the embedded grid space back to the original grid 
+ * space, starting the search for the grid cell at lastx,lasty.
+ * Returns 0 if successful, 1 if the point lies outside of the morphing grid.
+ */
+static int project_back_pixel (double px, double py, double *ox, double *oy, 
+							   morph *grid, int *lastx, int *lasty) {
+	
+	double i, j;
 	int cellx, celly;
 	int ok;
-	double ax, ay, bx, by, cx, cy, dx, dy, px, py;
+	
+	
+	// Get the grid cell in which the provided points lies, starting from
+	// the previous cell if there is one.
+	cellx = *lastx;
+	celly = *lasty;
+	ok = grid_cell_walk(px, py, grid, &cellx, &celly);
+	if (ok != 0) {
+		return 1;
+	}
+	*lastx = cellx;
+	*lasty = celly;
+	
+	// Compute the i and j for the bilinear interpolation.
+	ok = invert_bilinear(px, py, grid, cellx, celly, &i, &j);
+	if (ok != 0) {
+		fprintf(stderr, "[ScapeToadPy] Error. Cannot make back projection in cell %i,%i.\n", cellx, celly);
+		i = j = 0.5;
+	}
+	
+	*ox = (double)cellx + i;
+	*oy = (double)celly + j;
+	
+	return 0;
+}
+
+
+
+
+int project_back_coord_walk (double xembedded, double yembedded, double *xorig, double *yorig, 
+							 morph *grid, int *lastx, int *lasty) {
+	
+	double px, py;
+	int ok;
 	
 	
 	// Transform the point from geographic coordinates to the grid space.
@@ -342,51 +642,73 @@ int project_back_coord (double xembedded, double yembedded, double *xorig, doubl
 		return 1;
 	}
 	
-	// Get the grid cell in which the provided points lies.
 	// If the point lies outside the morphing grid, we return the input coordinates.
-	ok = grid_cell_for_coordinate(px, py, grid, &cellx, &celly);
+	ok = project_back_pixel(px, py, &px, &py, grid, lastx, lasty);
 	if (ok != 0) {
 		*xorig = xembedded;
 		*yorig = yembedded;
 		return 0;
 	}
 	
-	// Compute the i and j for the bilinear interpolation.
-	ax = grid->x[cellx][celly];
-	ay = grid->y[cellx][celly];
-	bx = grid->x[cellx+1][celly];
-	by = grid->y[cellx+1][celly];
-	cx = grid->x[cellx+1][celly+1];
-	cy = grid->y[cellx+1][celly+1];
-	dx = grid->x[cellx][celly+1];
-	dy = grid->y[cellx][celly+1];
-	i1 = (ay*bx - ax*by - ay*cx + ax*cy + ay*dx - ax*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py - (ay*bx*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py - sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py,2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) + (ax*by*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py - sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) *  (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) + (ay*cx*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py - sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay *px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) - (ax*cy*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py - sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) - (by*dx*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py - sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) + (cy*dx*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py - sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) + (bx*dy*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py - sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) - (cx*dy*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py - sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy))) / (-ay*cx + by*cx + ax*cy - bx*cy + ay*dx - by*dx - ax*dy + bx*dy);
-	j1 = (2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py - sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy));
-	i2 = (ay*bx - ax*by - ay*cx + ax*cy + ay*dx - ax*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py - (ay*bx*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py + sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) + (ax*by*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py + sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) + (ay*cx*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py + sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) - (ax*cy*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py + sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) - (by*dx*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py + sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) + (cy*dx*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py + sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) + (bx*dy*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py + sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy)) - (cx*dy*(2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py + sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2)))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy))) / (-ay*cx + by*cx + ax*cy - bx*cy + ay*dx - by*dx - ax*dy + bx*dy);
-	j2 = (2*ay*bx - 2*ax*by - ay*cx + ax*cy + by*dx - bx*dy - ay*px + by*px - cy*px + dy*px + ax*py - bx*py + cx*py - dx*py + sqrt(-4*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy) * (ay*bx - ax*by - ay*px + by*px + ax*py - bx*py) + pow(-2*ay*bx + 2*ax*by + ay*cx - ax*cy - by*dx + bx*dy + ay*px - by*px + cy*px - dy*px - ax*py + bx*py - cx*py + dx*py, 2))) / (2*(ay*bx - ax*by - ay*cx + ax*cy + by*dx - cy*dx - bx*dy + cx*dy));
-	
-	if (i1 >= 0.0 && i1 <= 1.0) {
-		i = i1;
-	} else if (i2 >= 0.0 && i2 <= 1.0) {
-		i = i2;
-	} else {
-		fprintf(stderr, "[ScapeToadPy] Error. Cannot make back projection, value i invalid.\n");
+	point_pixel_to_geo(px, py, xorig, yorig, grid->georef);
+	
+	return 0;
+}
+
+
+
+
+morph *invert_grid (morph *mg, int refine)
+{
+	morph *inv;
+	int ix, iy, lastx, lasty;
+	double px, py, ox, oy;
+	
+	
+	if (refine < 1) {
+		fprintf(stderr, "[ScapeToadPy] Error. The refinement factor must be at least 1.\n");
+		return NULL;
 	}
 	
-	if (j1 >= 0.0 && j1 <= 1.0) {
-		j = j1;
-	} else if (j2 >= 0.0 && j2 <= 1.0) {
-		j = j2;
-	} else {
-		fprintf(stderr, "[ScapeToadPy] Error. Cannot make back projection, value j invalid.\n");
+	inv = create_morph(mg->xsize * refine, mg->ysize * refine);
+	if (inv == NULL) {
+		return NULL;
 	}
 	
+	// The inverse grid covers the same region, with refine times more cells
+	// in each direction.
+	inv->georef[0] = mg->georef[0];
+	inv->georef[1] = mg->georef[1] / refine;
+	inv->georef[2] = mg->georef[2] / refine;
+	inv->georef[3] = mg->georef[3];
+	inv->georef[4] = mg->georef[4] / refine;
+	inv->georef[5] = mg->georef[5] / refine;
+	
+	// The index must exist before the threads start walking.
+	if (morph_build_index(mg) != 0) {
+		free_morph(inv);
+		return NULL;
+	}
 	
-	px = (double)cellx + i;
-	py = (double)celly + j;
-	point_pixel_to_geo(px, py, xorig, yorig, grid->georef);
+	// Back project every node of the inverse grid. Nodes outside the
+	// morphed grid are not moved. Consecutive nodes of a column are close
+	// to each other, so every column keeps its own starting cell.
+#pragma omp parallel for default(shared) private(ix, iy, lastx, lasty, px, py, ox, oy) schedule(dynamic)
+	for (ix = 0; ix <= inv->xsize; ix++) {
+		lastx = lasty = -1;
+		for (iy = 0; iy <= inv->ysize; iy++) {
+			px = (double)ix / refine;
+			py = (double)iy / refine;
+			if (project_back_pixel(px, py, &ox, &oy, mg, &lastx, &lasty) != 0) {
+				ox = px;
+				oy = py;
+			}
+			MORPH_X(inv, ix, iy) = ox * refine;
+			MORPH_Y(inv, ix, iy) = oy * refine;
+		}
+	}
 	
-	return 0;
+	return inv;
 }
 
 
@@ -408,7 +730,7 @@ int scale_coord (double x, double y, double scale, double centrex, double centre
 
 
 int project_wkt (char *wktin, char *wktout, int maxlen_wkt, 
-				 double **gridx, double **gridy, int xsize, int ysize,
+				 double *gridx, double *gridy, int xsize, int ysize,
 				 double geoTransform[6], 
 				 double scale, double centrex, double centrey)
 {
@@ -502,25 +824,102 @@ int project_wkt (char *wktin, char *wktout, int maxlen_wkt,
 
 
 
-int project_geom(OGRGeometryH geom, morph *grid, int back_transform) {
+/*
+ * Makes sure the scratch arrays can hold n points.
+ * Returns 0 if successful, 1 otherwise.
+ */
+static int coord_buffer_reserve(coord_buffer *buf, int n) {
 	
-	int i;
+	int size;
+	
+	if (n <= buf->size) {
+		return 0;
+	}
+	
+	size = (buf->size > 0) ? buf->size : 256;
+	while (size < n) {
+		size *= 2;
+	}
+	
+	free(buf->x);
+	free(buf->y);
+	free(buf->z);
+	buf->x = malloc(size * sizeof(double));
+	buf->y = malloc(size * sizeof(double));
+	buf->z = malloc(size * sizeof(double));
+	if (buf->x == NULL || buf->y == NULL || buf->z == NULL) {
+		fprintf(stderr, "Error. Unable to allocate memory for projecting a geometry.\n");
+		buf->size = 0;
+		return 1;
+	}
+	buf->size = size;
+	
+	return 0;
+}
+
+
+
+
+void free_coord_buffer(coord_buffer *buf) {
+	free(buf->x);
+	free(buf->y);
+	free(buf->z);
+	buf->x = buf->y = buf->z = NULL;
+	buf->size = 0;
+}
+
+
+
+
+/*
+ * Projects a geometry, keeping track of the last grid cell found
+ * during the back transform in cellx, celly.
+ */
+static int project_geom_walk(OGRGeometryH geom, morph *grid, int back_transform, 
+							 coord_buffer *buf, int *cellx, int *celly) {
+	
+	int i, n;
 	double x, y, z, x_proj, y_proj;
 	
 	// If the geometry is not directly projectable, call recursively
 	// for each composing geometry.
 	if (OGR_G_GetGeometryCount(geom) > 0) {
 		for (i = 0; i < OGR_G_GetGeometryCount(geom); i++) {
-			project_geom(OGR_G_GetGeometryRef(geom, i), grid, back_transform);
+			project_geom_walk(OGR_G_GetGeometryRef(geom, i), grid, back_transform, buf, cellx, celly);
 		}
 		return 0;
 	}
 	
+	// Empty geometries are left unchanged. OGR_G_GetPoints and
+	// OGR_G_SetPoints would turn an empty point into a real point.
+	n = OGR_G_GetPointCount(geom);
+	if (n == 0) {
+		return 0;
+	}
+	
+#ifdef HAVE_OGR_POINT_ARRAYS
+	// Project all points at once.
+	if (buf != NULL && coord_buffer_reserve(buf, n) == 0) {
+		OGR_G_GetPoints(geom, buf->x, sizeof(double), buf->y, sizeof(double), 
+						buf->z, sizeof(double));
+		if (back_transform) {
+			for (i = 0; i < n; i++) {
+				project_back_coord_walk(buf->x[i], buf->y[i], &buf->x[i], &buf->y[i], grid, cellx, celly);
+			}
+		} else {
+			project_coord_array(buf->x, buf->y, n, grid);
+		}
+		OGR_G_SetPoints(geom, n, buf->x, sizeof(double), buf->y, sizeof(double), 
+						(OGR_G_GetCoordinateDimension(geom) > 2) ? buf->z : NULL, sizeof(double));
+		return 0;
+	}
+#endif
+	
 	// Project every point separately.
-	for (i = 0; i < OGR_G_GetPointCount(geom); i++) {
+	for (i = 0; i < n; i++) {
 		OGR_G_GetPoint(geom, i, &x, &y, &z);
 		if (back_transform) {
-			project_back_coord(x, y, &x_proj, &y_proj, grid);
+			project_back_coord_walk(x, y, &x_proj, &y_proj, grid, cellx, celly);
 		} else {
 			project_coord(x, y, &x_proj, &y_proj, grid->x, grid->y, grid->xsize, grid->ysize, grid->georef);
 		}
@@ -533,41 +932,265 @@ int project_geom(OGRGeometryH geom, morph *grid, int back_transform) {
 
 
 
+int project_geom_buf(OGRGeometryH geom, morph *grid, int back_transform, coord_buffer *buf) {
+	
+	int cellx, celly;
+	
+	// Consecutive vertices mostly lie in the same or in a neighbouring
+	// cell, so the point location starts from the cell of the previous one.
+	cellx = celly = -1;
+	return project_geom_walk(geom, grid, back_transform, buf, &cellx, &celly);
+}
+
+
 
-int grid_cell_for_coordinate (double coordx, double coordy, morph *mg, int *cellx, int *celly) {
+
+int project_geom(OGRGeometryH geom, morph *grid, int back_transform) {
 	
-	int i, j;
-	double xpoly[5], ypoly[5];
-	double xmin, xmax, ymin, ymax;
+	coord_buffer buf;
+	int ok;
+	
+	buf.size = 0;
+	buf.x = buf.y = buf.z = NULL;
+	ok = project_geom_buf(geom, grid, back_transform, &buf);
+	free_coord_buffer(&buf);
+	
+	return ok;
+}
+
+
+
+
+
+/*
+ * Computes the bounding box of the morphed grid cell i,j.
+ */
+static void grid_cell_bbox (morph *mg, int i, int j, 
+							double *xmin, double *ymin, double *xmax, double *ymax)
+{
+	double x00, x10, x01, x11, y00, y10, y01, y11;
+	
+	x00 = MORPH_X(mg, i, j);	y00 = MORPH_Y(mg, i, j);
+	x10 = MORPH_X(mg, i+1, j);	y10 = MORPH_Y(mg, i+1, j);
+	x01 = MORPH_X(mg, i, j+1);	y01 = MORPH_Y(mg, i, j+1);
+	x11 = MORPH_X(mg, i+1, j+1);	y11 = MORPH_Y(mg, i+1, j+1);
 	
-	// We need to find the 4 coordinates of the cell.
+	*xmin = MIN(MIN(x00, x10), MIN(x01, x11));
+	*xmax = MAX(MAX(x00, x10), MAX(x01, x11));
+	*ymin = MIN(MIN(y00, y10), MIN(y01, y11));
+	*ymax = MAX(MAX(y00, y10), MAX(y01, y11));
+}
+
+
+
+
+/*
+ * Computes the range of buckets covered by the given bounding box.
+ */
+static void morph_index_range (morph_index *idx, 
+							   double xmin, double ymin, double xmax, double ymax,
+							   int *bx0, int *by0, int *bx1, int *by1)
+{
+	*bx0 = (int)((xmin - idx->minx) / idx->bw);
+	*bx1 = (int)((xmax - idx->minx) / idx->bw);
+	*by0 = (int)((ymin - idx->miny) / idx->bh);
+	*by1 = (int)((ymax - idx->miny) / idx->bh);
+	
+	*bx0 = MAX(0, MIN(*bx0, idx->nbx-1));
+	*bx1 = MAX(0, MIN(*bx1, idx->nbx-1));
+	*by0 = MAX(0, MIN(*by0, idx->nby-1));
+	*by1 = MAX(0, MIN(*by1, idx->nby-1));
+}
+
+
+
+
+int morph_build_index(morph *mg)
+{
+	morph_index *idx;
+	int i, j, bx, by, bx0, by0, bx1, by1;
+	size_t b, nbuckets, *fill;
+	double xmin, ymin, xmax, ymax, maxx, maxy;
+	
+	
+	if (mg->index != NULL) {
+		return 0;
+	}
+	
+	idx = malloc(sizeof(morph_index));
+	if (idx == NULL) {
+		return 1;
+	}
+	
+	// Extent of the morphed grid.
+	idx->minx = maxx = mg->x[0];
+	idx->miny = maxy = mg->y[0];
+	for (b = 0; b < (size_t)(mg->xsize+1) * (mg->ysize+1); b++) {
+		idx->minx = MIN(idx->minx, mg->x[b]);
+		maxx = MAX(maxx, mg->x[b]);
+		idx->miny = MIN(idx->miny, mg->y[b]);
+		maxy = MAX(maxy, mg->y[b]);
+	}
+	
+	// About one bucket per grid cell.
+	idx->nbx = mg->xsize;
+	idx->nby = mg->ysize;
+	idx->bw = (maxx - idx->minx) / idx->nbx;
+	idx->bh = (maxy - idx->miny) / idx->nby;
+	if (idx->bw <= 0.0) idx->bw = 1.0;
+	if (idx->bh <= 0.0) idx->bh = 1.0;
+	
+	nbuckets = (size_t)idx->nbx * idx->nby;
+	idx->start = calloc(nbuckets + 1, sizeof(size_t));
+	fill = malloc(nbuckets * sizeof(size_t));
+	if (idx->start == NULL || fill == NULL) {
+		fprintf(stderr, "Error. Unable to allocate memory for the morphing grid index.\n");
+		free(idx->start);
+		free(fill);
+		free(idx);
+		return 1;
+	}
+	
+	// First pass: count the cells per bucket.
 	for (j = 0; j < mg->ysize; j++) {
 		for (i = 0; i < mg->xsize; i++) {
-			
-			xmin = MIN(mg->x[i][j], mg->x[i][j+1]);
-			xmax = MAX(mg->x[i+1][j], mg->x[i+1][j+1]);
-			ymin = MIN(mg->y[i][j], mg->y[i+1][j]);
-			ymax = MAX(mg->y[i][j+1], mg->y[i+1][j+1]);
-			
-			//fprintf(stderr, "%f %f / %f %f\n", xmin, ymin, xmax, ymax);
+			grid_cell_bbox(mg, i, j, &xmin, &ymin, &xmax, &ymax);
+			morph_index_range(idx, xmin, ymin, xmax, ymax, &bx0, &by0, &bx1, &by1);
+			for (by = by0; by <= by1; by++) {
+				for (bx = bx0; bx <= bx1; bx++) {
+					idx->start[(size_t)by*idx->nbx + bx + 1]++;
+				}
+			}
+		}
+	}
+	for (b = 0; b < nbuckets; b++) {
+		idx->start[b+1] += idx->start[b];
+		fill[b] = idx->start[b];
+	}
+	
+	idx->cells = malloc(idx->start[nbuckets] * sizeof(int));
+	if (idx->cells == NULL) {
+		fprintf(stderr, "Error. Unable to allocate memory for the morphing grid index.\n");
+		free(idx->start);
+		free(fill);
+		free(idx);
+		return 1;
+	}
+	
+	// Second pass: register the cells.
+	for (j = 0; j < mg->ysize; j++) {
+		for (i = 0; i < mg->xsize; i++) {
+			grid_cell_bbox(mg, i, j, &xmin, &ymin, &xmax, &ymax);
+			morph_index_range(idx, xmin, ymin, xmax, ymax, &bx0, &by0, &bx1, &by1);
+			for (by = by0; by <= by1; by++) {
+				for (bx = bx0; bx <= bx1; bx++) {
+					b = (size_t)by*idx->nbx + bx;
+					idx->cells[fill[b]++] = j*mg->xsize + i;
+				}
+			}
+		}
+	}
+	
+	free(fill);
+	mg->index = idx;
+	
+	return 0;
+}
 
-			
-			if (xmin <= coordx && xmax >= coordx &&
-				ymin <= coordy && ymax >= coordy)
-			{
-				xpoly[0]=mg->x[i][j]; xpoly[1]=mg->x[i][j+1]; xpoly[2]=mg->x[i+1][j+1]; 
-				xpoly[3]=mg->x[i+1][j]; xpoly[4]=mg->x[i][j];
-				
-				ypoly[0]=mg->y[i][j]; ypoly[1]=mg->y[i][j+1]; ypoly[2]=mg->y[i+1][j+1]; 
-				ypoly[3]=mg->y[i+1][j]; ypoly[4]=mg->y[i][j];
-				
-				if (point_in_polygon(coordx, coordy, xpoly, ypoly, 5) == 1) {
+
+
+
+
+int grid_cell_contains (double coordx, double coordy, morph *mg, int i, int j) {
+	
+	double xpoly[5], ypoly[5];
+	double xmin, xmax, ymin, ymax;
+	double turn[4], side, tol;
+	int e, convex;
+	
+	grid_cell_bbox(mg, i, j, &xmin, &ymin, &xmax, &ymax);
+	if (xmin > coordx || xmax < coordx || ymin > coordy || ymax < coordy) {
+		return 0;
+	}
+	
+	xpoly[0]=MORPH_X(mg, i, j); xpoly[1]=MORPH_X(mg, i, j+1); xpoly[2]=MORPH_X(mg, i+1, j+1); 
+	xpoly[3]=MORPH_X(mg, i+1, j); xpoly[4]=MORPH_X(mg, i, j);
+	
+	ypoly[0]=MORPH_Y(mg, i, j); ypoly[1]=MORPH_Y(mg, i, j+1); ypoly[2]=MORPH_Y(mg, i+1, j+1); 
+	ypoly[3]=MORPH_Y(mg, i+1, j); ypoly[4]=MORPH_Y(mg, i, j);
+	
+	// A convex cell contains the point if the point lies on the inner side 
+	// of all edges. Points on an edge (up to rounding) belong to the cell,
+	// which the crossing count below can not guarantee.
+	for (e = 0; e < 4; e++) {
+		turn[e] = (xpoly[e+1]-xpoly[e]) * (ypoly[(e+2)%4]-ypoly[e+1]) - 
+				  (ypoly[e+1]-ypoly[e]) * (xpoly[(e+2)%4]-xpoly[e+1]);
+	}
+	convex = (turn[0] > 0 && turn[1] > 0 && turn[2] > 0 && turn[3] > 0) ||
+			 (turn[0] < 0 && turn[1] < 0 && turn[2] < 0 && turn[3] < 0);
+	if (convex) {
+		for (e = 0; e < 4; e++) {
+			side = (xpoly[e+1]-xpoly[e]) * (coordy-ypoly[e]) - (ypoly[e+1]-ypoly[e]) * (coordx-xpoly[e]);
+			tol = 1e-12 * (fabs(xpoly[e+1]-xpoly[e]) + fabs(ypoly[e+1]-ypoly[e])) * 
+				  (1 + fabs(coordx) + fabs(coordy));
+			if ((turn[0] > 0 && side < -tol) || (turn[0] < 0 && side > tol)) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+	
+	return (point_in_polygon(coordx, coordy, xpoly, ypoly, 5) == 1);
+}
+
+
+
+
+
+
+int grid_cell_for_coordinate (double coordx, double coordy, morph *mg, int *cellx, int *celly) {
+	
+	morph_index *idx;
+	int i, j, bx, by;
+	size_t k;
+	
+	
+	if (mg->index == NULL && morph_build_index(mg) != 0) {
+		
+		// Without index, test every cell.
+		for (j = 0; j < mg->ysize; j++) {
+			for (i = 0; i < mg->xsize; i++) {
+				if (grid_cell_contains(coordx, coordy, mg, i, j)) {
 					*cellx = i;
 					*celly = j;
 					return 0;
 				}
 			}
-			
+		}
+		return 1;
+	}
+	
+	// Find the bucket of the coordinate, and test only the cells in it.
+	idx = mg->index;
+	if (coordx < idx->minx || coordy < idx->miny) {
+		return 1;
+	}
+	bx = (int)((coordx - idx->minx) / idx->bw);
+	by = (int)((coordy - idx->miny) / idx->bh);
+	if (bx == idx->nbx) bx--;		// Points on the upper border.
+	if (by == idx->nby) by--;
+	if (bx >= idx->nbx || by >= idx->nby) {
+		return 1;
+	}
+	
+	k = (size_t)by*idx->nbx + bx;
+	for (k = idx->start[k]; k < idx->start[(size_t)by*idx->nbx + bx + 1]; k++) {
+		i = idx->cells[k] % mg->xsize;
+		j = idx->cells[k] / mg->xsize;
+		if (grid_cell_contains(coordx, coordy, mg, i, j)) {
+			*cellx = i;
+			*celly = j;
+			return 0;
 		}
 	}
 	
@@ -580,6 +1203,67 @@ int grid_cell_for_coordinate (double coordx, double coordy, morph *mg, int *cell
 
 
 
+int grid_cell_walk (double coordx, double coordy, morph *mg, int *cellx, int *celly) {
+	
+	int i, j, step, e, ni, nj;
+	double qx[5], qy[5], mx, my, side, inside;
+	
+	
+	i = *cellx;
+	j = *celly;
+	if (i < 0 || j < 0 || i >= mg->xsize || j >= mg->ysize) {
+		return grid_cell_for_coordinate(coordx, coordy, mg, cellx, celly);
+	}
+	
+	for (step = 0; step < MAXWALK; step++) {
+		
+		// Corners of the cell in counter-clockwise grid order, and its centre.
+		qx[0] = MORPH_X(mg, i, j);		qy[0] = MORPH_Y(mg, i, j);
+		qx[1] = MORPH_X(mg, i+1, j);	qy[1] = MORPH_Y(mg, i+1, j);
+		qx[2] = MORPH_X(mg, i+1, j+1);	qy[2] = MORPH_Y(mg, i+1, j+1);
+		qx[3] = MORPH_X(mg, i, j+1);	qy[3] = MORPH_Y(mg, i, j+1);
+		qx[4] = qx[0];					qy[4] = qy[0];
+		mx = 0.25 * (qx[0] + qx[1] + qx[2] + qx[3]);
+		my = 0.25 * (qy[0] + qy[1] + qy[2] + qy[3]);
+		
+		// Find an edge with the point and the centre on opposite sides.
+		// Edges 0 to 3 lead to the cells below, right, above and left.
+		for (e = 0; e < 4; e++) {
+			side = (qx[e+1]-qx[e])*(coordy-qy[e]) - (qy[e+1]-qy[e])*(coordx-qx[e]);
+			inside = (qx[e+1]-qx[e])*(my-qy[e]) - (qy[e+1]-qy[e])*(mx-qx[e]);
+			if (side * inside < 0.0) {
+				break;
+			}
+		}
+		
+		if (e == 4) {
+			// The point is on the inner side of all edges.
+			if (grid_cell_contains(coordx, coordy, mg, i, j)) {
+				*cellx = i;
+				*celly = j;
+				return 0;
+			}
+			break;
+		}
+		
+		ni = i + (e == 1) - (e == 3);
+		nj = j + (e == 2) - (e == 0);
+		if (ni < 0 || nj < 0 || ni >= mg->xsize || nj >= mg->ysize) {
+			break;
+		}
+		i = ni;
+		j = nj;
+	}
+	
+	// The walk failed, use the spatial index.
+	return grid_cell_for_coordinate(coordx, coordy, mg, cellx, celly);
+}
+
+
+
+
+
+
 int point_in_polygon(double ptx, double pty, double *xpoly, double *ypoly, int npts)
 {
 	
@@ -628,11 +1312,11 @@ int point_in_polygon(double ptx, double pty, double *xpoly, double *ypoly, int n
 	for (i = 0; i <= (npts-2); i++)
 	{
 		// Crossing or not?
-		if ((xpoly[i] < ptx && xpoly[i+1] > ptx) || (xpoly[i] > ptx && xpoly[i+1] < ptx)) {
+		if ((xpoly[i] < ptx && xpoly[i+1] >= ptx) || (xpoly[i] > ptx && xpoly[i+1] <= ptx)) {
 			// Crossing of the y-axis through the point.
 			// Compute the intersection point.
 			// Add 1 to left or right crossing.
-			crossing = ypoly[i] + ((ptx - xpoly[i]) * (ypoly[i+1] - ypoly[i+1]) / (xpoly[i+1] - xpoly[i]));
+			crossing = ypoly[i] + ((ptx - xpoly[i]) * (ypoly[i+1] - ypoly[i]) / (xpoly[i+1] - xpoly[i]));
 			// Right crossing or left crossing?
 			if (crossing > pty) {
 				upperCrossings++;
@@ -20,23 +20,108 @@
 #include <stdlib.h>
 
 #include <GDAL/ogr_api.h>
+#include <GDAL/gdal_version.h>
 
 
+/*
+ * OGR_G_GetPoints and OGR_G_SetPoints allow reading and writing all the
+ * points of a geometry at once.
+ */
+#if defined(GDAL_VERSION_NUM) && GDAL_VERSION_NUM >= 2000000
+#  define HAVE_OGR_POINT_ARRAYS 1
+#endif
+
+
+
+
+
+/*
+ * Binary morphing grid file format.
+ * The file starts with a header of 64 bytes:
+ *    char[8]      magic string MORPH_BINARY_MAGIC
+ *    int32        xsize
+ *    int32        ysize
+ *    double[6]    georeference
+ * followed by the (xsize+1)*(ysize+1) x coordinates and the same number of
+ * y coordinates as doubles, in column-major order (all points of column 0
+ * first). Numbers are stored in the native byte order (little-endian on all
+ * supported platforms). The point arrays are aligned on 8 bytes, which allows
+ * to map the file into memory without copying it.
+ */
+#define MORPH_BINARY_MAGIC "STMGRID1"
+#define MORPH_BINARY_HEADER_SIZE 64
+
+
+
+
+/*
+ * Spatial index over the morphed grid cells, used for finding the cell
+ * containing a given point in the embedded space (back transform).
+ * It is a uniform grid of buckets; every bucket holds the numbers
+ * (j*xsize + i) of the cells whose bounding box intersects the bucket.
+ * The cell numbers of bucket b are cells[start[b]] to cells[start[b+1]-1].
+ */
+typedef struct {
+	int nbx;
+	int nby;
+	double minx;
+	double miny;
+	double bw;
+	double bh;
+	size_t *start;
+	int *cells;
+} morph_index;
+
+
+
+
+/*
+ * Scratch arrays for projecting the points of a geometry at once.
+ * The arrays grow as needed, and can be reused for many geometries.
+ * Initialise all members to 0 and release with free_coord_buffer.
+ */
+typedef struct {
+	int size;
+	double *x;
+	double *y;
+	double *z;
+} coord_buffer;
+
 
 
 
 /*
  * Structure for storing a morphing grid.
+ * The (xsize+1)*(ysize+1) grid points are stored in a single contiguous
+ * buffer in column-major order, with all x coordinates first, followed by
+ * all y coordinates (the same layout as in the binary file). Use MORPH_X
+ * and MORPH_Y for accessing a point.
+ * If the grid has been mapped from a binary file, map points to the
+ * mapped file and map_size is its size; map is NULL otherwise.
+ * The spatial index for back transforms is built on first use, or by
+ * calling morph_build_index.
  */
 typedef struct {
 	int xsize;
 	int ysize;
 	double georef[6];
-	double **x;
-	double **y;
+	double *x;
+	double *y;
+	void *map;
+	size_t map_size;
+	morph_index *index;
 } morph;
 
 
+/*
+ * Index of grid point ix,iy in a column-major grid with ysize+1 rows.
+ */
+#define GRID_IDX(ix, iy, ysize)	((size_t)(ix) * ((ysize)+1) + (iy))
+
+#define MORPH_X(mg, ix, iy)		((mg)->x[GRID_IDX(ix, iy, (mg)->ysize)])
+#define MORPH_Y(mg, ix, iy)		((mg)->y[GRID_IDX(ix, iy, (mg)->ysize)])
+
+
 
 
 /*
@@ -54,6 +139,19 @@ void free_morph(morph* mg);
 
 
 
+/*
+ * morph_build_index
+ * Builds the spatial index over the morphed grid cells if it does not
+ * exist yet. This should be called once before back transforming
+ * coordinates from several threads.
+ * Returns 0 in case of success, 1 otherwise.
+ */
+int morph_build_index(morph *mg);
+
+
+
+
+
 /*
  * point_geo_to_pixel
  * Translates a geographic point to a pixel coordinate using
@@ -85,7 +183,7 @@ int point_pixel_to_geo (double pixelx, double pixely, double *geox, double *geoy
  * Returns 0 if successful; 1 if the file ended early.
  */
 int read_grid_points (FILE *stream, 
-					  double **gridx, double **gridy, 
+					  double *gridx, double *gridy, 
 					  int xsize, int ysize);
 
 
@@ -103,9 +201,33 @@ int read_grid_georef(FILE *stream, double *geoTransform);
 
 
 
+/*
+ * read_grid_binary
+ * Maps a binary morphing grid file into memory. The grid points are not
+ * copied; the returned structure points directly into the mapped file.
+ * Returns a pointer to morphing grid sturcture, or NULL on failure.
+ */
+morph* read_grid_binary (char *file);
+
+
+
+
+/*
+ * write_grid
+ * Writes a morphing grid to a file, either in the text format or, if
+ * binary is not 0, in the binary format.
+ * Returns 0 if successful, 1 otherwise.
+ */
+int write_grid (char *file, morph *mg, int binary);
+
+
+
+
 /*
  * read_grid
  * Reads a whole grid file and allocates the memory for holding the grid points.
+ * Both the text and the binary grid formats are supported; binary files
+ * are mapped into memory.
  * Returns a pointer to morphing grid sturcture, or NULL on failure.
  */
 //morph* read_grid (char *file, double **gridx, double **gridy, int *xsize, int *ysize, double *georef);
@@ -121,12 +243,23 @@ morph* read_grid (char *file);
  */
 int project_coord (double xgeo, double ygeo, 
 				   double *xout, double *yout,
-				   double **gridx, double **gridy, int xsize, int ysize,
+				   double *gridx, double *gridy, int xsize, int ysize,
 				   double geoTransform[6]);
 
 
 
 
+/* project_coord_array
+ * Projects n coordinates in place using the provided morphing grid.
+ * Gives the same result as project_coord for every coordinate, but
+ * the georeference is only read once and the loop can be vectorised.
+ * Returns 0 if successful, 1 if there was a problem.
+ */
+int project_coord_array (double *x, double *y, int n, morph *grid);
+
+
+
+
 /* project_back_coord
  * Projects a single coordinate from the embedded space to the original space
  * using the provided morphing grid.
@@ -139,6 +272,32 @@ int project_back_coord (double xembedded, double yembedded, double *xorig, doubl
 
 
 
+/* project_back_coord_walk
+ * Same as project_back_coord, but the search for the grid cell starts at
+ * the cell lastx,lasty (ignored if negative) and walks across the
+ * neighbouring cells. lastx,lasty are updated with the cell found, which
+ * makes the search nearly free for consecutive vertices of a geometry.
+ * Returns 0 if successful, 1 if a problem occured.
+ */
+int project_back_coord_walk (double xembedded, double yembedded, double *xorig, double *yorig, 
+							 morph *grid, int *lastx, int *lasty);
+
+
+
+
+/* invert_grid
+ * Computes the inverse of a morphing grid by back projecting every node
+ * of a regular lattice covering the same region. The lattice has refine
+ * times more cells than the morphing grid in each direction.
+ * Projecting with the inverse grid (project_coord) gives the back
+ * transform of the original grid, up to the interpolation error.
+ * Returns the inverse grid, or NULL if a problem occured.
+ */
+morph *invert_grid (morph *mg, int refine);
+
+
+
+
 /* 
  * scale_coord
  * Scales a coordinate point given by x/y by the given scale and using the provided centre.
@@ -154,7 +313,7 @@ int scale_coord (double x, double y, double scale, double centrex, double centre
  * Projects a WKT geometry using the provided morphping grid.
  */
 int project_wkt (char *wktin, char *wktout, int maxlen_wkt, 
-				 double **gridx, double **gridy, int xsize, int ysize,
+				 double *gridx, double *gridy, int xsize, int ysize,
 				 double geoTransform[6], 
 				 double scale, double centrex, double centrey);
 
@@ -164,18 +323,40 @@ int project_wkt (char *wktin, char *wktout, int maxlen_wkt,
 /*
  * project_geom
  * Projects a OGR geometry using the provided morphing grid.
+ * For the back transform, the grid cells are located by walking from
+ * the cell of the previous vertex.
  */
 int project_geom(OGRGeometryH geom, morph *grid, int back_transform);
 
 
 
 
+/*
+ * project_geom_buf
+ * Same as project_geom, but the points of each part are projected at once
+ * using the provided scratch arrays.
+ */
+int project_geom_buf(OGRGeometryH geom, morph *grid, int back_transform, coord_buffer *buf);
+
+
+
+
+/*
+ * free_coord_buffer
+ * Frees the scratch arrays of a coordinate buffer.
+ */
+void free_coord_buffer(coord_buffer *buf);
+
+
+
+
 
 /*
  * grid_cell_for_coordinate
  * Finds the grid cell in which the provided coordinate lies.
  * It provides the values i and j; in this case the coordinate lies inside the polygon
  * defined by the points i,j / i+1,j / i+1,j+1 / i,j+1
+ * Only the cells registered in the spatial index for the coordinate are tested.
  * It return 0 in case of success, 1 in case of an error.
  */
 int grid_cell_for_coordinate (double coordx, double coordy, morph *mg, int *cellx, int *celly);
@@ -183,6 +364,28 @@ int grid_cell_for_coordinate (double coordx, double coordy, morph *mg, int *cell
 
 
 
+/*
+ * grid_cell_walk
+ * Finds the grid cell in which the provided coordinate lies by walking
+ * from the cell cellx,celly towards the coordinate. Falls back to
+ * grid_cell_for_coordinate if the start cell is invalid or if the walk fails.
+ * It return 0 in case of success, 1 in case of an error.
+ */
+int grid_cell_walk (double coordx, double coordy, morph *mg, int *cellx, int *celly);
+
+
+
+
+/*
+ * grid_cell_contains
+ * Tests if the coordinate (in grid space) lies inside the morphed grid cell i,j.
+ * Returns 1 if this is the case, 0 otherwise.
+ */
+int grid_cell_contains (double coordx, double coordy, morph *mg, int i, int j);
+
+
+
+
 
 /*
  * point_in_polygon
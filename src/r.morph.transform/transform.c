@@ -10,6 +10,9 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 #include <GDAL/gdal.h>
 #include <GDAL/ogr_api.h>
@@ -19,14 +22,263 @@
 #include "transform.h"
 
 
+#define WARP_STRIP 256		// Number of rows warped at once
+#define WARP_MAXSTEP 16		// Maximum step of the inverse mapping lattice
+#define VT_BATCH 1024		// Number of features per batch in vector_transform
+#define COORD_BUFSIZE (1 << 20)	// Size of the input and output buffers in coord_transform
+#define COORD_BATCH 4096	// Number of coordinates projected at once in coord_transform
+#define COORD_MAXCHARS 330	// Maximum length of a formatted coordinate
 
 
 
-int coord_transform(char *morphfile, int back_transform) {
+
+
+/*
+ * Parses a floating point number starting at *p, and advances *p to the
+ * first character after the number. Numbers with at most 19 significant
+ * digits and a small exponent are converted exactly without strtod;
+ * other numbers are handed over to strtod. Returns 1 if a number has
+ * been read, 0 otherwise.
+ */
+static int parse_coord(char **p, char *end, double *value) {
+	
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	char *s, *start, tmp[64];
+	unsigned long long mant;
+	int neg, ndigits, exp10, e, eneg, any;
+	double v;
+	
+	s = start = *p;
+	neg = 0;
+	if (s < end && (*s == '-' || *s == '+')) {
+		neg = (*s == '-');
+		s++;
+	}
+	
+	mant = 0;
+	ndigits = exp10 = any = 0;
+	while (s < end && *s >= '0' && *s <= '9') {
+		if (ndigits < 19) {
+			mant = mant * 10 + (*s - '0');
+			if (mant > 0) ndigits++;
+		} else {
+			exp10++;
+		}
+		any = 1;
+		s++;
+	}
+	if (s < end && *s == '.') {
+		s++;
+		while (s < end && *s >= '0' && *s <= '9') {
+			if (ndigits < 19) {
+				mant = mant * 10 + (*s - '0');
+				if (mant > 0) ndigits++;
+				exp10--;
+			}
+			any = 1;
+			s++;
+		}
+	}
+	if (!any) {
+		return 0;
+	}
+	if (s < end && (*s == 'e' || *s == 'E')) {
+		e = eneg = 0;
+		s++;
+		if (s < end && (*s == '-' || *s == '+')) {
+			eneg = (*s == '-');
+			s++;
+		}
+		while (s < end && *s >= '0' && *s <= '9') {
+			if (e < 10000) e = e * 10 + (*s - '0');
+			s++;
+		}
+		exp10 += eneg ? -e : e;
+	}
+	
+	if (mant < (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+		// Both the mantissa and the power of ten are exact doubles,
+		// so a single multiplication or division rounds correctly.
+		v = (double)mant;
+		v = (exp10 < 0) ? v / pow10[-exp10] : v * pow10[exp10];
+		*value = neg ? -v : v;
+	} else {
+		if (s - start >= (int)sizeof(tmp)) {
+			return 0;
+		}
+		memcpy(tmp, start, s - start);
+		tmp[s - start] = '\0';
+		*value = strtod(tmp, NULL);
+	}
+	
+	*p = s;
+	return 1;
+}
+
+
+
+
+/*
+ * Writes value with 6 decimals (as printf's %f) at s.
+ * Returns the number of characters written.
+ */
+static int format_coord(char *s, double value) {
+	
+	char digits[24];
+	unsigned long long v, ip, fp;
+	double r, frac;
+	int n, i;
+	
+	// Large and non-finite values are left to snprintf.
+	if (!(fabs(value) < 1e9)) {
+		return snprintf(s, COORD_MAXCHARS, "%f", value);
+	}
+	
+	n = 0;
+	if (signbit(value)) {
+		s[n++] = '-';
+		value = -value;
+	}
+	
+	// Values too close to a rounding tie are also left to snprintf, 
+	// as value * 1e6 is not exact.
+	r = value * 1e6;
+	frac = r - floor(r);
+	if (fabs(frac - 0.5) <= r * 4e-16 + 1e-300) {
+		return n + snprintf(s + n, COORD_MAXCHARS, "%f", value);
+	}
+	v = (unsigned long long)(r + 0.5);
+	ip = v / 1000000;
+	fp = v % 1000000;
+	
+	i = 0;
+	do {
+		digits[i++] = '0' + (ip % 10);
+		ip /= 10;
+	} while (ip > 0);
+	while (i > 0) {
+		s[n++] = digits[--i];
+	}
+	s[n++] = '.';
+	for (i = 5; i >= 0; i--) {
+		s[n + i] = '0' + (fp % 10);
+		fp /= 10;
+	}
+	
+	return n + 6;
+}
+
+
+
+
+/*
+ * Projects n coordinates in place. The back transform starts the
+ * point location from the cell of the previous coordinate.
+ */
+static void project_coord_batch(double *x, double *y, int n, morph *grid, int back_transform, 
+								int *cellx, int *celly) {
+	int i;
+	if (back_transform) {
+		for (i = 0; i < n; i++) {
+			project_back_coord_walk(x[i], y[i], &x[i], &y[i], grid, cellx, celly);
+		}
+	} else {
+		project_coord_array(x, y, n, grid);
+	}
+}
+
+
+
+
+/*
+ * Swaps the byte order of a double if the machine is big endian.
+ */
+static double le_double(double v) {
+	
+	unsigned int one = 1;
+	unsigned char *b, t;
+	int i;
+	
+	if (*((unsigned char*)&one) == 1) {
+		return v;
+	}
+	b = (unsigned char*)&v;
+	for (i = 0; i < 4; i++) {
+		t = b[i];
+		b[i] = b[7-i];
+		b[7-i] = t;
+	}
+	return v;
+}
+
+
+
+
+/*
+ * Transforms the binary coordinate pairs read from standard input.
+ */
+static int coord_transform_binary(morph *grid, int back_transform) {
+	
+	double *pairs, *x, *y;
+	size_t nread, rest;
+	int i, n, cellx, celly;
+	
+	pairs = malloc(2 * COORD_BATCH * sizeof(double));
+	x = malloc(COORD_BATCH * sizeof(double));
+	y = malloc(COORD_BATCH * sizeof(double));
+	if (pairs == NULL || x == NULL || y == NULL) {
+		fprintf(stderr, "Error. Unable to allocate memory for the coordinates.\n");
+		exit(1);
+	}
+	
+	cellx = celly = -1;
+	rest = 0;
+	while ((nread = fread((char*)pairs + rest, 1, 2 * COORD_BATCH * sizeof(double) - rest, stdin)) > 0) {
+		nread += rest;
+		n = nread / (2 * sizeof(double));
+		rest = nread - n * 2 * sizeof(double);
+		
+		for (i = 0; i < n; i++) {
+			x[i] = le_double(pairs[2*i]);
+			y[i] = le_double(pairs[2*i+1]);
+		}
+		project_coord_batch(x, y, n, grid, back_transform, &cellx, &celly);
+		for (i = 0; i < n; i++) {
+			pairs[2*i] = le_double(x[i]);
+			pairs[2*i+1] = le_double(y[i]);
+		}
+		fwrite(pairs, 2 * sizeof(double), n, stdout);
+		
+		// Keep an incomplete pair for the next read.
+		if (rest > 0) {
+			memmove(pairs, (char*)pairs + n * 2 * sizeof(double), rest);
+		}
+	}
+	if (rest > 0) {
+		fprintf(stderr, "Error. Incomplete coordinate pair at the end of the input.\n");
+	}
+	fflush(stdout);
+	
+	free(pairs);
+	free(x);
+	free(y);
+	
+	return (rest > 0) ? 1 : 0;
+}
+
+
+
+
+int coord_transform(char *morphfile, int back_transform, int binary) {
 	
 	morph *grid;
-	char coords[1000], space[1000];
-	double x, y, proj_x, proj_y;
+	char *in, *out, *p, *end, *line_end;
+	size_t len, nread, nout;
+	double *x, *y;
+	char *line_ok;
+	int i, j, n, nlines, cellx, celly, eof, ok;
 	
 	// Read the input morph file
 	grid = read_grid(morphfile);
@@ -35,16 +287,120 @@ int coord_transform(char *morphfile, int back_transform) {
 		exit(1);
 	}
 	
-	while (fgets(coords, 1000, stdin)) {
-		sscanf(coords, "%lf%[, \t;]%lf\n", &x, space, &y);
-		if (back_transform) {
-			project_back_coord(x, y, &proj_x, &proj_y, grid);
+	// The spatial index is only needed for the back transform.
+	if (back_transform) {
+		morph_build_index(grid);
+	}
+	
+	if (binary) {
+		ok = coord_transform_binary(grid, back_transform);
+		free_morph(grid);
+		return ok;
+	}
+	
+	in = malloc(COORD_BUFSIZE + 1);
+	out = malloc(COORD_BUFSIZE);
+	x = malloc(COORD_BATCH * sizeof(double));
+	y = malloc(COORD_BATCH * sizeof(double));
+	line_ok = malloc(COORD_BATCH);
+	if (in == NULL || out == NULL || x == NULL || y == NULL || line_ok == NULL) {
+		fprintf(stderr, "Error. Unable to allocate memory for the coordinates.\n");
+		exit(1);
+	}
+	
+	// Read the input in large blocks. Lines are parsed in the block, and
+	// an incomplete line at the end of the block is moved to its start
+	// before reading the next block. Every line contains two numbers 
+	// separated by spaces, tabs, commas or semicolons. Other lines, 
+	// including blank lines, are written as 'nan nan', so that the output 
+	// has one line for every input line.
+	cellx = celly = -1;
+	len = 0;
+	eof = 0;
+	while (!eof) {
+		nread = fread(in + len, 1, COORD_BUFSIZE - len, stdin);
+		if (nread < COORD_BUFSIZE - len) {
+			eof = 1;
+		}
+		len += nread;
+		end = in + len;
+		
+		p = in;
+		while (p < end) {
+			
+			// Collect a batch of lines. Only the valid coordinates are
+			// stored in x and y.
+			n = 0;
+			nlines = 0;
+			while (nlines < COORD_BATCH && p < end) {
+				line_end = memchr(p, '\n', end - p);
+				if (line_end == NULL) {
+					if (!eof && p > in) break;		// Incomplete line
+					if (!eof) {
+						fprintf(stderr, "Error. Input line too long.\n");
+						exit(1);
+					}
+					line_end = end;
+				}
+				line_ok[nlines] = 0;
+				while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+				if (parse_coord(&p, line_end, &x[n])) {
+					while (p < line_end && (*p == ' ' || *p == '\t' || *p == ',' || *p == ';')) p++;
+					if (parse_coord(&p, line_end, &y[n])) {
+						line_ok[nlines] = 1;
+						n++;
+					}
+				}
+				nlines++;
+				p = line_end + 1;
+			}
+			if (nlines == 0) {
+				break;
+			}
+			
+			project_coord_batch(x, y, n, grid, back_transform, &cellx, &celly);
+			
+			// Write the batch.
+			nout = 0;
+			j = 0;
+			for (i = 0; i < nlines; i++) {
+				if (nout + 2 * COORD_MAXCHARS + 2 > COORD_BUFSIZE) {
+					fwrite(out, 1, nout, stdout);
+					nout = 0;
+				}
+				if (!line_ok[i]) {
+					memcpy(out + nout, "nan\tnan\n", 8);
+					nout += 8;
+					continue;
+				}
+				nout += format_coord(out + nout, x[j]);
+				out[nout++] = '\t';
+				nout += format_coord(out + nout, y[j]);
+				out[nout++] = '\n';
+				j++;
+			}
+			fwrite(out, 1, nout, stdout);
+			
+			if (line_end == NULL) {
+				break;
+			}
+		}
+		
+		// Move the incomplete line to the start of the buffer.
+		if (p < end) {
+			len = end - p;
+			memmove(in, p, len);
 		} else {
-			project_coord(x, y, &proj_x, &proj_y, grid->x, grid->y, grid->xsize, grid->ysize, grid->georef);
+			len = 0;
 		}
-		fprintf(stdout, "%f\t%f\n", proj_x, proj_y);
 	}
+	fflush(stdout);
 	
+	free(in);
+	free(out);
+	free(x);
+	free(y);
+	free(line_ok);
 	free_morph(grid);
 	
 	return 0;
@@ -53,16 +409,271 @@ int coord_transform(char *morphfile, int back_transform) {
 
 
 
-int raster_transform(char *infile, char *morphfile, char *outfile, char *format, int back_transform) {
+int invert_transform(char *morphfile, char *outfile, int refine, int binary) {
+	
+	morph *grid, *inv;
+	int ok;
+	
+	// Read the input morph file
+	grid = read_grid(morphfile);
+	if (grid == NULL) {
+		fprintf(stderr, "Error. Unable to read input morph file '%s'\n", morphfile);
+		exit(1);
+	}
+	
+	inv = invert_grid(grid, refine);
+	if (inv == NULL) {
+		fprintf(stderr, "Error. Unable to compute the inverse morph grid.\n");
+		exit(1);
+	}
+	
+	ok = write_grid(outfile, inv, binary);
+	
+	free_morph(inv);
+	free_morph(grid);
+	
+	return ok;
+}
+
+
+
+
+int raster_transform(char *infile, char *morphfile, char *outfile, char *format, int back_transform, 
+					 int bilinear) {
+	
+	GDALDriverH drvr;
+	GDALDatasetH in_ds, out_ds;
+	GDALRasterBandH in_band, out_band;
+	morph *mgrid;
+	double georef[6];
+	int xsize, ysize, nbands, band;
+	int step, nlx, nly;
+	double *lx, *ly;			// Input pixel coordinates at the lattice nodes
+	double *win, *buf;			// Input window and output strip
+	int y0, nrows, wy0, wy1;
+	int i, j, cellx, celly, has_nodata;
+	size_t k;
+	double px, py, gx, gy, ix, iy, nodata, lymin, lymax;
+	
 	
-	fprintf(stderr, "Error. Raster transform currently not implemented.\n");
 	GDALAllRegister();
+	
+	// Open the input raster
+	in_ds = GDALOpen(infile, GA_ReadOnly);
+	if (in_ds == NULL) {
+		fprintf(stderr, "Error. Unable to open input raster '%s'\n", infile);
+		exit(1);
+	}
+	xsize = GDALGetRasterXSize(in_ds);
+	ysize = GDALGetRasterYSize(in_ds);
+	nbands = GDALGetRasterCount(in_ds);
+	GDALGetGeoTransform(in_ds, georef);
+	
+	// Read the input morph file
+	mgrid = read_grid(morphfile);
+	if (mgrid == NULL) {
+		fprintf(stderr, "Error. Unable to read input morph file '%s'\n", morphfile);
+		GDALClose(in_ds);
+		exit(1);
+	}
+	
+	// The output raster is sampled through the inverse mapping, which is
+	// the back transform for a forward warp.
+	if (back_transform == 0) {
+		morph_build_index(mgrid);
+	}
+	
+	// Create the output raster, with the same size and georeference
+	// as the input raster.
+	if (format != NULL) {
+		drvr = GDALGetDriverByName(format);
+		if (drvr == NULL) {
+			fprintf(stderr, "Error. Unable to find a driver for format '%s'.\n", format);
+			GDALClose(in_ds);
+			free_morph(mgrid);
+			exit(1);
+		}
+	} else {
+		drvr = GDALGetDatasetDriver(in_ds);
+	}
+	out_ds = GDALCreate(drvr, outfile, xsize, ysize, nbands, 
+						GDALGetRasterDataType(GDALGetRasterBand(in_ds, 1)), NULL);
+	if (out_ds == NULL) {
+		fprintf(stderr, "Error. Unable to create output raster '%s'\n", outfile);
+		GDALClose(in_ds);
+		free_morph(mgrid);
+		exit(1);
+	}
+	GDALSetGeoTransform(out_ds, georef);
+	GDALSetProjection(out_ds, GDALGetProjectionRef(in_ds));
+	
+	
+	// Precompute the inverse mapping (output pixel to input pixel) on a
+	// lattice of output pixels. The lattice step follows the size of the
+	// morph grid cells, but is at most WARP_MAXSTEP pixels.
+	step = (int)fabs(mgrid->georef[1] / georef[1]);
+	if (step < 1) step = 1;
+	if (step > WARP_MAXSTEP) step = WARP_MAXSTEP;
+	nlx = (xsize + step - 1) / step + 1;
+	nly = (ysize + step - 1) / step + 1;
+	lx = malloc((size_t)nlx * nly * sizeof(double));
+	ly = malloc((size_t)nlx * nly * sizeof(double));
+	if (lx == NULL || ly == NULL) {
+		fprintf(stderr, "Error. Not enough memory for the inverse mapping.\n");
+		exit(1);
+	}
+	
+#pragma omp parallel for default(shared) private(i, j, k, px, py, gx, gy, ix, iy, cellx, celly) schedule(dynamic)
+	for (j = 0; j < nly; j++) {
+		cellx = celly = -1;
+		for (i = 0; i < nlx; i++) {
+			k = (size_t)j * nlx + i;
+			px = i * step + 0.5;
+			py = j * step + 0.5;
+			point_pixel_to_geo(px, py, &gx, &gy, georef);
+			if (back_transform) {
+				project_coord(gx, gy, &ix, &iy, mgrid->x, mgrid->y, mgrid->xsize, mgrid->ysize, mgrid->georef);
+			} else {
+				project_back_coord_walk(gx, gy, &ix, &iy, mgrid, &cellx, &celly);
+			}
+			point_geo_to_pixel(ix, iy, &lx[k], &ly[k], georef);
+		}
+	}
+	
+	
+	// Warp every band, strip by strip. Every strip is read as one window
+	// of the input raster, resampled in parallel, and written at once.
+	buf = malloc((size_t)xsize * WARP_STRIP * sizeof(double));
+	for (band = 1; band <= nbands; band++) {
+		
+		in_band = GDALGetRasterBand(in_ds, band);
+		out_band = GDALGetRasterBand(out_ds, band);
+		nodata = GDALGetRasterNoDataValue(in_band, &has_nodata);
+		if (has_nodata) {
+			GDALSetRasterNoDataValue(out_band, nodata);
+		} else {
+			nodata = 0.0;
+		}
+		
+		for (y0 = 0; y0 < ysize; y0 += WARP_STRIP) {
+			
+			nrows = (y0 + WARP_STRIP <= ysize) ? WARP_STRIP : ysize - y0;
+			
+			// Input rows needed for the strip.
+			lymin = ysize;
+			lymax = -1;
+			for (j = y0 / step; j <= (y0 + nrows - 1) / step + 1; j++) {
+				for (i = 0; i < nlx; i++) {
+					k = (size_t)j * nlx + i;
+					if (ly[k] < lymin) lymin = ly[k];
+					if (ly[k] > lymax) lymax = ly[k];
+				}
+			}
+			wy0 = (int)floor(lymin) - 1;
+			wy1 = (int)floor(lymax) + 1;
+			if (wy0 < 0) wy0 = 0;
+			if (wy1 > ysize - 1) wy1 = ysize - 1;
+			
+			win = NULL;
+			if (wy0 <= wy1) {
+				win = malloc((size_t)xsize * (wy1 - wy0 + 1) * sizeof(double));
+				if (win == NULL) {
+					fprintf(stderr, "Error. Not enough memory for reading the input raster.\n");
+					exit(1);
+				}
+				GDALRasterIO(in_band, GF_Read, 0, wy0, xsize, wy1 - wy0 + 1, 
+							 win, xsize, wy1 - wy0 + 1, GDT_Float64, 0, 0);
+			}
+			
+#pragma omp parallel for default(shared) private(j) schedule(static)
+			for (j = 0; j < nrows; j++) {
+				warp_row(buf + (size_t)j * xsize, y0 + j, xsize, 
+						 lx, ly, nlx, step, 
+						 win, wy0, wy1, nodata, has_nodata, bilinear);
+			}
+			
+			GDALRasterIO(out_band, GF_Write, 0, y0, xsize, nrows, buf, xsize, nrows, GDT_Float64, 0, 0);
+			
+			if (win != NULL) {
+				free(win);
+			}
+		}
+	}
+	
+	
+	// Free the ressources
+	free(buf);
+	free(lx);
+	free(ly);
+	GDALClose(in_ds);
+	GDALClose(out_ds);
+	free_morph(mgrid);
+	
 	return 0;
 }
 
 
 
 
+void warp_row(double *out, int y, int xsize, 
+			  double *lx, double *ly, int nlx, int step, 
+			  double *win, int wy0, int wy1, double nodata, int has_nodata, int bilinear) {
+	
+	int x, iu, iv, ix, iy;
+	size_t k;
+	double u, v, fu, fv, sx, sy, fx, fy, v00, v10, v01, v11;
+	
+	v = (double)y / step;
+	iv = (int)v;
+	fv = v - iv;
+	
+	for (x = 0; x < xsize; x++) {
+		
+		out[x] = nodata;
+		if (win == NULL) {
+			continue;
+		}
+		
+		// Input pixel coordinates, interpolated from the lattice.
+		u = (double)x / step;
+		iu = (int)u;
+		fu = u - iu;
+		k = (size_t)iv * nlx + iu;
+		sx = (1-fu)*(1-fv)*lx[k] + fu*(1-fv)*lx[k+1] + (1-fu)*fv*lx[k+nlx] + fu*fv*lx[k+nlx+1];
+		sy = (1-fu)*(1-fv)*ly[k] + fu*(1-fv)*ly[k+1] + (1-fu)*fv*ly[k+nlx] + fu*fv*ly[k+nlx+1];
+		
+		if (bilinear) {
+			fx = sx - 0.5;
+			fy = sy - 0.5;
+			ix = (int)floor(fx);
+			iy = (int)floor(fy);
+			if (ix >= 0 && ix + 1 < xsize && iy >= wy0 && iy + 1 <= wy1) {
+				fx -= ix;
+				fy -= iy;
+				k = (size_t)(iy - wy0) * xsize + ix;
+				v00 = win[k];
+				v10 = win[k+1];
+				v01 = win[k+xsize];
+				v11 = win[k+xsize+1];
+				if (!has_nodata || (v00 != nodata && v10 != nodata && v01 != nodata && v11 != nodata)) {
+					out[x] = (1-fx)*(1-fy)*v00 + fx*(1-fy)*v10 + (1-fx)*fy*v01 + fx*fy*v11;
+					continue;
+				}
+			}
+		}
+		
+		// Nearest neighbour.
+		ix = (int)floor(sx);
+		iy = (int)floor(sy);
+		if (ix >= 0 && ix < xsize && iy >= wy0 && iy <= wy1) {
+			out[x] = win[(size_t)(iy - wy0) * xsize + ix];
+		}
+	}
+}
+
+
+
+
 int vector_transform(char *infile, char *input_layer,  char *spatial_filter, char *attr_filter,
 					 char *morphfile, 
 					 char *outfile, char *attrs, char *format, char *output_layer,
@@ -72,11 +683,12 @@ int vector_transform(char *infile, char *input_layer,  char *spatial_filter, cha
 	OGRDataSourceH in_ds, out_ds;
 	OGRLayerH in_lyr, out_lyr;
 	OGRFeatureDefnH schema;
-	OGRFeatureH in_feat, out_feat;
-	OGRGeometryH in_geom, out_geom;
+	feature_batch batches[3];		// Batches being read, projected and written.
+	feature_batch *cur, *next, *prev;
+	coord_buffer buf;				// Scratch arrays of each thread.
 	morph *mgrid;
 	double xmin, xmax, ymin, ymax;
-	int ok;
+	int ok, i, t, eof, write_errors;
 	
 	
 	OGRRegisterAll();
@@ -120,6 +732,9 @@ int vector_transform(char *infile, char *input_layer,  char *spatial_filter, cha
 		OGR_DS_Destroy(in_ds);
 		exit(1);
 	}
+	if (back_transform) {
+		morph_build_index(mgrid);
+	}
 	
 	
 	// Create the output datasource
@@ -162,28 +777,65 @@ int vector_transform(char *infile, char *input_layer,  char *spatial_filter, cha
 	
 	// Make a copy of the OGR feature definition for the new layer
 	ogr_layer_copy_schema(in_lyr, &out_lyr, attrs);
+	write_errors = 0;
 	
 	
-	// Loop through the input features and transform the geometry.
+	// Transform the features in a pipeline of batches. While the features of
+	// one batch are projected by all threads, one thread reads the next batch
+	// and another one writes the previous batch. The output order is the
+	// input order.
+	for (i = 0; i < 3; i++) {
+		batches[i].nfeat = 0;
+		batches[i].feat = malloc(VT_BATCH * sizeof(OGRFeatureH));
+		batches[i].geom = malloc(VT_BATCH * sizeof(OGRGeometryH));
+	}
 	OGR_L_ResetReading(in_lyr);
-	while ((in_feat = OGR_L_GetNextFeature(in_lyr)) != NULL) {
-		
-		// Create a new feature and copy the attributes.
-		out_feat = OGR_F_Create(OGR_L_GetLayerDefn(out_lyr));
-		ogr_feat_copy_attributes(in_feat, &out_feat, attrs);
-		
-		// Project the geometry.
-		in_geom = OGR_F_GetGeometryRef(in_feat);
-		out_geom = OGR_G_Clone(in_geom);
-		project_geom(out_geom, mgrid, back_transform);
-		OGR_F_SetGeometry(out_feat, out_geom);
-		OGR_G_DestroyGeometry(out_geom);
+	eof = read_feature_batch(in_lyr, &batches[0]);
+	
+	for (t = 0; ; t++) {
 		
-		// Write the new feature to the output layer.
-		OGR_L_CreateFeature(out_lyr, out_feat);
-		OGR_F_Destroy(out_feat);
+		cur = &batches[t % 3];
+		next = &batches[(t+1) % 3];
+		prev = &batches[(t+2) % 3];
+		if (cur->nfeat == 0 && prev->nfeat == 0) {
+			break;
+		}
+		next->nfeat = 0;
 		
-		OGR_F_Destroy(in_feat);
+#pragma omp parallel default(shared) private(i, buf)
+		{
+			buf.size = 0;
+			buf.x = buf.y = buf.z = NULL;
+			
+#pragma omp single nowait
+			{
+				if (!eof) {
+					eof = read_feature_batch(in_lyr, next);
+				}
+			}
+#pragma omp single nowait
+			{
+				if (write_feature_batch(out_lyr, prev, attrs) != 0) {
+					write_errors++;
+				}
+			}
+#pragma omp for schedule(dynamic, 16) nowait
+			for (i = 0; i < cur->nfeat; i++) {
+				if (cur->geom[i] != NULL) {
+					project_geom_buf(cur->geom[i], mgrid, back_transform, &buf);
+				}
+			}
+			
+			free_coord_buffer(&buf);
+		}
+	}
+	
+	for (i = 0; i < 3; i++) {
+		free(batches[i].feat);
+		free(batches[i].geom);
+	}
+	if (write_errors > 0) {
+		fprintf(stderr, "Error. Unable to write some features to the output layer.\n");
 	}
 	
 	
@@ -199,4 +851,69 @@ int vector_transform(char *infile, char *input_layer,  char *spatial_filter, cha
 
 
 
+int read_feature_batch(OGRLayerH lyr, feature_batch *batch) {
+	
+	OGRFeatureH feat;
+	
+	batch->nfeat = 0;
+	while (batch->nfeat < VT_BATCH) {
+		feat = OGR_L_GetNextFeature(lyr);
+		if (feat == NULL) {
+			return 1;
+		}
+		
+		// Take over the geometry of the input feature, so it can be
+		// projected in place.
+#if defined(GDAL_VERSION_NUM) && GDAL_VERSION_NUM >= 2030000
+		batch->geom[batch->nfeat] = OGR_F_StealGeometry(feat);
+#else
+		batch->geom[batch->nfeat] = OGR_F_GetGeometryRef(feat);
+		if (batch->geom[batch->nfeat] != NULL) {
+			batch->geom[batch->nfeat] = OGR_G_Clone(batch->geom[batch->nfeat]);
+		}
+#endif
+		batch->feat[batch->nfeat] = feat;
+		batch->nfeat++;
+	}
+	
+	return 0;
+}
+
+
+
+
+int write_feature_batch(OGRLayerH lyr, feature_batch *batch, char *attrs) {
+	
+	OGRFeatureH out_feat;
+	int i, ok;
+	
+	ok = 0;
+	for (i = 0; i < batch->nfeat; i++) {
+		
+		// Create a new feature and copy the attributes.
+		out_feat = OGR_F_Create(OGR_L_GetLayerDefn(lyr));
+		ogr_feat_copy_attributes(batch->feat[i], &out_feat, attrs);
+		
+		// The output feature takes the ownership of the projected geometry.
+		if (batch->geom[i] != NULL) {
+			OGR_F_SetGeometryDirectly(out_feat, batch->geom[i]);
+		}
+		
+		// Write the new feature to the output layer.
+		if (OGR_L_CreateFeature(lyr, out_feat) != OGRERR_NONE) {
+			ok = 1;
+		}
+		OGR_F_Destroy(out_feat);
+		
+		OGR_F_Destroy(batch->feat[i]);
+	}
+	batch->nfeat = 0;
+	
+	return ok;
+}
+
+
+
+
+
 
@@ -9,23 +9,81 @@
 
 
 
+#include <GDAL/ogr_api.h>
+
+
+
 /*
  * Allows transforming coordinates read from standard input.
  * Writes the result back to standard out.
+ * If binary is set, the input and output are pairs of little-endian
+ * 64-bit floating point numbers instead of text lines.
+ */
+int coord_transform(char *morphfile, int back_transform, int binary);
+
+
+/*
+ * Computes the inverse of a morph file and writes it to outfile, in the
+ * binary grid format if binary is set. The inverse grid has refine times
+ * more cells in each direction. A forward transform with the inverse grid
+ * is a back transform with the original grid.
  */
-int coord_transform(char *morphfile, int back_transform);
+int invert_transform(char *morphfile, char *outfile, int refine, int binary);
 
 
 /*
  * Allows transform of a GDAL compatible raster image.
+ * The output raster has the same size and georeference as the input raster.
+ * Its pixels are resampled from the input raster using the inverse
+ * mapping, with nearest neighbour or, if bilinear is set, bilinear
+ * interpolation. Strips of rows are resampled in parallel.
+ */
+int raster_transform(char *infile, char *morphfile, char *outfile, char *format, int back_transform, 
+					 int bilinear);
+
+
+/*
+ * Resamples output row y of a warped raster.
+ * lx, ly are the input pixel coordinates on a lattice of nlx columns with
+ * the given step, and win contains the input rows wy0 to wy1 (or NULL if
+ * no input row is needed).
  */
-int raster_transform(char *infile, char *morphfile, char *outfile, char *format, int back_transform);
+void warp_row(double *out, int y, int xsize, 
+			  double *lx, double *ly, int nlx, int step, 
+			  double *win, int wy0, int wy1, double nodata, int has_nodata, int bilinear);
+
+
+/*
+ * A batch of features in the vector transform pipeline.
+ * geom[i] is the geometry taken from feat[i], which is projected in place.
+ */
+typedef struct {
+	int nfeat;
+	OGRFeatureH *feat;
+	OGRGeometryH *geom;
+} feature_batch;
 
 
 /*
  * Allows transform of a OGR compatbile vector layer.
+ * The features are read, projected (by all threads) and written in a
+ * pipeline of batches.
  */
 int vector_transform(char *infile, char *input_layer, char *spatial_filter, char *attr_filter,
 					 char *morphfile, 
 					 char *outfile, char *attrs, char *format, char *output_layer, 
 					 int back_transform);
+
+
+/*
+ * Reads the next batch of features from the layer.
+ * Returns 1 if the end of the layer has been reached, 0 otherwise.
+ */
+int read_feature_batch(OGRLayerH lyr, feature_batch *batch);
+
+
+/*
+ * Writes a batch of projected features to the output layer, and frees
+ * the input features. Returns 0 if successful, 1 otherwise.
+ */
+int write_feature_batch(OGRLayerH lyr, feature_batch *batch, char *attrs);
@@ -10,27 +10,35 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <omp.h>
 
+#include <GDAL/gdal.h>
 #include <GDAL/ogr_api.h>
 
 #include "group_dist.h"
 
 
-int group_dist(char *infile, char *layer, char *group_attr, int median, int manhattan) {
+int group_dist(char *infile, char *layer, char *group_attr, int metric, int manhattan, 
+			   double median_error, char *outfile, int output_type, char *format) {
 
 	OGRDataSourceH ds;
 	OGRLayerH lyr;
 	OGRFeatureH feat;
 	OGRGeometryH geom;
-	int i, j;				// Iterator variables
+	OGRFeatureDefnH defn;
+	char **ignored;			// Names of the fields not read
+	int i, j, k;			// Iterator variables
 	int npts;				// Number of points
-	int *gid, *sgid;		// Array of group IDs
+	int gid;				// Group ID
 	int fidx;				// Field index
 	int ngrps;				// Number of groups
+	int grpcap;				// Allocated size of the group array
 	group *grps;			// Array with all the groups and points
+	group_table tbl;		// Hash table from group IDs to group indices
 	int grpidx;				// Group index
-	int ngrppts;			// Number of group points
+	double *dist;			// Upper triangle of the distance matrix
+	double cx, cy;			// Mean coordinates of all points
 	
 	
 	OGRRegisterAll();
@@ -51,244 +59,1133 @@ int group_dist(char *infile, char *layer, char *group_attr, int median, int manh
 		OGR_DS_Destroy(ds);
 		exit(1);
 	}
+	
+	// Get the field index for the group id attribute, and don't read
+	// the other attributes.
+	defn = OGR_L_GetLayerDefn(lyr);
+	fidx = OGR_FD_GetFieldIndex(defn, group_attr);
+	if (fidx < 0) {
+		fprintf(stderr, "Error. Unable to find attribute '%s'\n", group_attr);
+		OGR_DS_Destroy(ds);
+		exit(1);
+	}
+	ignored = malloc((OGR_FD_GetFieldCount(defn) + 2) * sizeof(char*));
+	if (ignored != NULL) {
+		k = 0;
+		for (i = 0; i < OGR_FD_GetFieldCount(defn); i++) {
+			if (i != fidx) {
+				ignored[k] = (char*)OGR_Fld_GetNameRef(OGR_FD_GetFieldDefn(defn, i));
+				k++;
+			}
+		}
+		ignored[k] = "OGR_STYLE";
+		ignored[k+1] = NULL;
+		OGR_L_SetIgnoredFields(lyr, (const char**)ignored);
+		free(ignored);
+	}
 	OGR_L_ResetReading(lyr);
 	
-	// Check the geometry type of the input layer, and count the number of points.
+	// Read all the points in a single pass. Each point is appended to
+	// the group with its group id, which is found using a hash table.
 	npts = 0;
-    while ((feat = OGR_L_GetNextFeature(lyr)) != NULL) {
+	ngrps = 0;
+	grpcap = 1024;
+	grps = malloc(grpcap * sizeof(group));
+	if (grps == NULL) {
+		fprintf(stderr, "Error. Not enough memory available.\n");
+		OGR_DS_Destroy(ds);
+		exit(1);
+	}
+	table_init(&tbl, 2 * grpcap);
+	while ((feat = OGR_L_GetNextFeature(lyr)) != NULL) {
 		geom = OGR_F_GetGeometryRef(feat);
 		if (geom != NULL && wkbFlatten(OGR_G_GetGeometryType(geom)) == wkbPoint) {
+			gid = OGR_F_GetFieldAsInteger(feat, fidx);
+			grpidx = table_find(&tbl, gid);
+			if (grpidx < 0) {
+				if (ngrps == grpcap) {
+					grpcap *= 2;
+					grps = realloc(grps, grpcap * sizeof(group));
+					if (grps == NULL) {
+						fprintf(stderr, "Error. Not enough memory available.\n");
+						OGR_DS_Destroy(ds);
+						exit(1);
+					}
+				}
+				grps[ngrps] = make_group(GD_GROUP_SIZE, gid);
+				table_insert(&tbl, gid, ngrps);
+				grpidx = ngrps;
+				ngrps++;
+			}
+			add_point(&grps[grpidx], OGR_G_GetX(geom, 0), OGR_G_GetY(geom, 0));
 			npts++;
 		}
 		OGR_F_Destroy(feat);
 	}
+	table_free(&tbl);
 	if (npts == 0) {
 		fprintf(stderr, "Error. Input file is not a point layer.\n");
 		OGR_DS_Destroy(ds);
 		exit(1);
 	}
-	OGR_L_ResetReading(lyr);
 	
-	// Collect the group id's of the features.
-	gid = malloc(npts * sizeof(int));
-	sgid = malloc(npts * sizeof(int));
-	if (gid == NULL || sgid == NULL) {
+	// The structure is now in place and we can start computing the distances.
+	
+	// We can close the OGR datasource. The groups are written in ascending
+	// order of their id.
+	OGR_DS_Destroy(ds);
+	qsort(grps, ngrps, sizeof(group), comp_group_id);
+	
+	// The mean Manhattan distance is computed from the sorted coordinates
+	// of the groups. They are sorted once here for all the pairs.
+	if (manhattan && metric == GD_MEAN) {
+		cx = cy = 0.0;
+		for (i = 0; i < ngrps; i++) {
+			for (j = 0; j < grps[i].npts; j++) {
+				cx += grps[i].x[j];
+				cy += grps[i].y[j];
+			}
+		}
+		cx /= (double)npts;
+		cy /= (double)npts;
+		#pragma omp parallel for default(shared) private(i) schedule(dynamic, 1)
+		for (i = 0; i < ngrps; i++) {
+			sort_group(&grps[i], cx, cy);
+		}
+	}
+	
+	// The nearest neighbour distances use a k-d tree for each group.
+	// The trees are built once here for all the pairs.
+	if (metric == GD_MIN || metric == GD_AVGNN || metric == GD_HAUSDORFF) {
+		#pragma omp parallel for default(shared) private(i) schedule(dynamic, 1)
+		for (i = 0; i < ngrps; i++) {
+			kd_build(grps[i].x, grps[i].y, 0, grps[i].npts, 0);
+		}
+	}
+	
+	// The results are stored as the upper triangle of the distance matrix.
+	dist = malloc(GD_TRI_SIZE(ngrps) * sizeof(double));
+	if (dist == NULL) {
+		fprintf(stderr, "Error. Not enough memory available for the distance matrix.\n");
+		exit(1);
+	}
+	
+	// Number of threads = number of processors (or cores)
+	#if defined (_OPENMP)
+	omp_set_num_threads(omp_get_num_procs());
+	#endif
+	// The distance is symmetric, so we compute it only once for each pair
+	// of groups. The rows of the upper triangle have different lengths and
+	// the groups different sizes, so the rows are distributed dynamically
+	// among the threads.
+	#pragma omp parallel for default(shared) private(i, j) schedule(dynamic, 1)
+	for (i = 0; i < ngrps; i++) {
+		for (j = i; j < ngrps; j++) {
+			dist[GD_TRI_IDX(i, j, ngrps)] = 
+				compute_group_distance(grps[i], grps[j], metric, manhattan, median_error);
+		}
+	}
+	
+	// Write the results.
+	switch (output_type) {
+		case GD_OUT_MATRIX:
+			write_matrix(outfile, dist, ngrps);
+			write_group_ids(outfile, grps, ngrps);
+			break;
+		case GD_OUT_TRIANGLE:
+			write_triangle(outfile, dist, ngrps);
+			write_group_ids(outfile, grps, ngrps);
+			break;
+		case GD_OUT_RASTER:
+			write_raster(outfile, format, dist, ngrps);
+			write_group_ids(outfile, grps, ngrps);
+			break;
+		default:
+			write_text(outfile, grps, dist, ngrps);
+	}
+	free(dist);
+	
+	
+	// Free the ressources for the group points.
+	for (i = 0; i < ngrps; i++) {
+		free_group(grps[i]);
+	}
+	free(grps);
+	
+	
+	return 0;
+}
+
+
+
+
+
+void write_text(char *outfile, group *grps, double *dist, int ngrps) {
+	
+	FILE *fp;
+	int i, j;
+	
+	if (outfile == NULL) {
+		fp = stdout;
+	} else {
+		fp = fopen(outfile, "w");
+		if (fp == NULL) {
+			fprintf(stderr, "Error. Unable to open output file '%s'.\n", outfile);
+			exit(1);
+		}
+	}
+	setvbuf(fp, NULL, _IOFBF, GD_OUT_BUFFER);
+	
+	fprintf(fp, "from_id\tto_id\tpt_distance\n");
+	for (i = 0; i < ngrps; i++) {
+		for (j = 0; j < ngrps; j++) {
+			fprintf(fp, "%d\t%d\t%f\n", grps[i].gid, grps[j].gid, 
+					(i <= j) ? dist[GD_TRI_IDX(i, j, ngrps)] : dist[GD_TRI_IDX(j, i, ngrps)]);
+		}
+	}
+	
+	if (fp != stdout) {
+		fclose(fp);
+	} else {
+		fflush(fp);
+	}
+}
+
+
+
+
+
+void matrix_row(double *dist, int ngrps, int i, double *row) {
+	int j;
+	for (j = 0; j < i; j++) {
+		row[j] = dist[GD_TRI_IDX(j, i, ngrps)];
+	}
+	memcpy(row + i, dist + GD_TRI_IDX(i, i, ngrps), (ngrps - i) * sizeof(double));
+}
+
+
+
+
+
+void write_matrix(char *outfile, double *dist, int ngrps) {
+	
+	FILE *fp;
+	double *row;
+	int i;
+	
+	fp = fopen(outfile, "wb");
+	row = malloc(ngrps * sizeof(double));
+	if (fp == NULL || row == NULL) {
+		fprintf(stderr, "Error. Unable to write output file '%s'.\n", outfile);
+		exit(1);
+	}
+	for (i = 0; i < ngrps; i++) {
+		matrix_row(dist, ngrps, i, row);
+		if (fwrite(row, sizeof(double), ngrps, fp) != (size_t)ngrps) {
+			fprintf(stderr, "Error. Unable to write output file '%s'.\n", outfile);
+			exit(1);
+		}
+	}
+	fclose(fp);
+	free(row);
+}
+
+
+
+
+
+void write_triangle(char *outfile, double *dist, int ngrps) {
+	
+	FILE *fp;
+	
+	fp = fopen(outfile, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Error. Unable to write output file '%s'.\n", outfile);
+		exit(1);
+	}
+	if (fwrite(dist, sizeof(double), GD_TRI_SIZE(ngrps), fp) != GD_TRI_SIZE(ngrps)) {
+		fprintf(stderr, "Error. Unable to write output file '%s'.\n", outfile);
+		exit(1);
+	}
+	fclose(fp);
+}
+
+
+
+
+
+void write_raster(char *outfile, char *format, double *dist, int ngrps) {
+	
+	GDALDriverH drv;
+	GDALDatasetH ds;
+	GDALRasterBandH band;
+	double *row;
+	int i;
+	
+	GDALAllRegister();
+	drv = GDALGetDriverByName(format);
+	if (drv == NULL) {
+		fprintf(stderr, "Error. Driver for format '%s' not available.\n", format);
+		exit(1);
+	}
+	ds = GDALCreate(drv, outfile, ngrps, ngrps, 1, GDT_Float64, NULL);
+	if (ds == NULL) {
+		fprintf(stderr, "Error. Unable to create output raster '%s'.\n", outfile);
+		exit(1);
+	}
+	band = GDALGetRasterBand(ds, 1);
+	row = malloc(ngrps * sizeof(double));
+	if (row == NULL) {
 		fprintf(stderr, "Error. Not enough memory available.\n");
-		OGR_DS_Destroy(ds);
 		exit(1);
 	}
-	i = 0;
-	while ((feat = OGR_L_GetNextFeature(lyr)) != NULL) {
-		// Get the field index for the group id attribute.
-		fidx = OGR_F_GetFieldIndex(feat, group_attr);
-		if (fidx < 0) {
-			fprintf(stderr, "Error. Unable to find attribute '%s'\n", group_attr);
-			OGR_DS_Destroy(ds);
-			OGR_F_Destroy(feat);
+	for (i = 0; i < ngrps; i++) {
+		matrix_row(dist, ngrps, i, row);
+		if (GDALRasterIO(band, GF_Write, 0, i, ngrps, 1, row, ngrps, 1, GDT_Float64, 0, 0) != CE_None) {
+			fprintf(stderr, "Error. Unable to write output raster '%s'.\n", outfile);
 			exit(1);
 		}
-		gid[i] = OGR_F_GetFieldAsInteger(feat, fidx);
-		sgid[i] = gid[i];
-		i++;
-		OGR_F_Destroy(feat);
 	}
-	OGR_L_ResetReading(lyr);
+	GDALClose(ds);
+	free(row);
+}
+
+
+
+
+
+void write_group_ids(char *outfile, group *grps, int ngrps) {
+	
+	FILE *fp;
+	char *idsfile;
+	int i;
 	
-	// Find out the number of group ids.
-	qsort(sgid, npts, sizeof(int), comp_int_asc);
-	ngrps = 1;
-	for (i = 1; i < npts; i++) {
-		if (sgid[i-1] != sgid[i]) {
-			ngrps++;
+	idsfile = malloc(strlen(outfile) + 5);
+	if (idsfile == NULL) {
+		fprintf(stderr, "Error. Not enough memory available.\n");
+		exit(1);
+	}
+	sprintf(idsfile, "%s.ids", outfile);
+	fp = fopen(idsfile, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Error. Unable to write group id file '%s'.\n", idsfile);
+		exit(1);
+	}
+	for (i = 0; i < ngrps; i++) {
+		fprintf(fp, "%d\n", grps[i].gid);
+	}
+	fclose(fp);
+	free(idsfile);
+}
+
+
+
+
+
+double compute_group_distance(group a, group b, int metric, int manhattan, 
+							  double median_error) {
+	switch (metric) {
+		case GD_MEDIAN:
+			return median_distance(a, b, manhattan, median_error);
+		case GD_MIN:
+		case GD_AVGNN:
+		case GD_HAUSDORFF:
+			return nn_distance(a, b, metric, manhattan);
+		default:
+			return mean_distance(a, b, manhattan);
+	}
+}
+
+
+
+
+
+double mean_distance(group a, group b, int manhattan) {
+	
+	int i, j, j0, n;
+	double *bx, *by;
+	double ax, ay, dx, dy, s, d;
+	
+	if (manhattan && a.sx != NULL && b.sx != NULL) {
+		return mean_manhattan_sorted(a, b);
+	}
+	
+	// The points of b are processed tile by tile; each tile is compared
+	// to all the points of a before moving on to the next one. As the tiles
+	// start on multiples of GD_TILE, they are aligned like the group arrays.
+	d = 0.0;
+	for (j0 = 0; j0 < b.npts; j0 += GD_TILE) {
+		n = MIN(GD_TILE, b.npts - j0);
+		bx = b.x + j0;
+		by = b.y + j0;
+		for (i = 0; i < a.npts; i++) {
+			ax = a.x[i];
+			ay = a.y[i];
+			s = 0.0;
+			if (manhattan) {
+				#pragma omp simd aligned(bx, by : GD_ALIGN) reduction(+:s)
+				for (j = 0; j < n; j++) {
+					s += fabs(ax - bx[j]) + fabs(ay - by[j]);
+				}
+			} else {
+				// sqrt is vectorized only if it does not have to set errno
+				// (-fno-math-errno with GCC, the default with Clang on Mac OS X).
+				#pragma omp simd aligned(bx, by : GD_ALIGN) private(dx, dy) reduction(+:s)
+				for (j = 0; j < n; j++) {
+					dx = ax - bx[j];
+					dy = ay - by[j];
+					s += sqrt(dx*dx + dy*dy);
+				}
+			}
+			d += s;
 		}
 	}
 	
+	return d / ((double)a.npts * (double)b.npts);
+}
+
+
+
+
+
+double mean_manhattan_sorted(group a, group b) {
+	double d;
+	d = sum_abs_diff(a.sx, a.npts, b.sx, b.psx, b.npts);
+	d += sum_abs_diff(a.sy, a.npts, b.sy, b.psy, b.npts);
+	return d / ((double)a.npts * (double)b.npts);
+}
+
+
+
+
+
+double sum_abs_diff(double *va, int na, double *vb, double *pb, int nb) {
+	
+	int i, j;
+	double v, s;
 	
-	// Collect information about the points in each group.
+	// For va[i], the j values of vb on its left contribute va[i]*j - pb[j],
+	// and the nb-j values on its right pb[nb] - pb[j] - va[i]*(nb-j).
+	s = 0.0;
+	j = 0;
+	for (i = 0; i < na; i++) {
+		v = va[i];
+		while (j < nb && vb[j] < v) {
+			j++;
+		}
+		s += v * (2*j - nb) + pb[nb] - 2.0*pb[j];
+	}
+	return s;
+}
+
+
+
+
+
+void sort_group(group *g, double cx, double cy) {
 	
-	// Allocate first the memory for holding all these group points.
-	grps = malloc(ngrps * sizeof(group));
-	if (grps == NULL) {
+	int i;
+	
+	g->sx = malloc(g->npts * sizeof(double));
+	g->sy = malloc(g->npts * sizeof(double));
+	g->psx = malloc((g->npts + 1) * sizeof(double));
+	g->psy = malloc((g->npts + 1) * sizeof(double));
+	if (g->sx == NULL || g->sy == NULL || g->psx == NULL || g->psy == NULL) {
 		fprintf(stderr, "Error. Not enough memory available.\n");
-		free(gid);
-		free(sgid);
-		OGR_DS_Destroy(ds);
 		exit(1);
 	}
+	for (i = 0; i < g->npts; i++) {
+		g->sx[i] = g->x[i] - cx;
+		g->sy[i] = g->y[i] - cy;
+	}
+	qsort(g->sx, g->npts, sizeof(double), comp_dbl);
+	qsort(g->sy, g->npts, sizeof(double), comp_dbl);
+	g->psx[0] = g->psy[0] = 0.0;
+	for (i = 0; i < g->npts; i++) {
+		g->psx[i+1] = g->psx[i] + g->sx[i];
+		g->psy[i+1] = g->psy[i] + g->sy[i];
+	}
+}
+
+
+
+
+
+double median_distance(group a, group b, int manhattan, double median_error) {
+	
+	int i, j0, j, n, k;
+	size_t cnt;
+	double d, dk, dk1, *dist;
+	kll_sketch sk;
+	
+	cnt = (size_t)a.npts * (size_t)b.npts;
 	
-	grpidx = 0;
-	ngrppts = 1;
-	for (i = 1; i < npts; i++) {
-		if (sgid[i-1] != sgid[i]) {
-			grps[grpidx] = make_group(ngrppts, sgid[i-1]);
-			ngrppts = 1;
-			grpidx++;
+	// Exact median.
+	if (median_error <= 0.0) {
+		select_distances(a, b, manhattan, (cnt - 1) / 2, &dk, &dk1);
+		if (cnt % 2 == 0) {
+			return (dk + dk1) / 2.0;
 		}
-		ngrppts++;
+		return dk;
 	}
-	grps[grpidx] = make_group(ngrppts, sgid[i-1]);
 	
-	// We don't need the sorted group id's anymore.
-	free(sgid);
+	// Approximate median. The rank error of the KLL sketch is about 3.3 / k
+	// (with a probability of 99%).
+	k = (int)ceil(3.3 / median_error);
+	if (k < 8) {
+		k = 8;
+	}
+	dist = malloc(GD_TILE * sizeof(double));
+	if (dist == NULL) {
+		fprintf(stderr, "Error. Not enough memory available.\n");
+		exit(1);
+	}
+	kll_init(&sk, k, (unsigned int)a.gid * 2654435761u ^ (unsigned int)b.gid);
+	for (j0 = 0; j0 < b.npts; j0 += GD_TILE) {
+		n = MIN(GD_TILE, b.npts - j0);
+		for (i = 0; i < a.npts; i++) {
+			tile_distances(a.x[i], a.y[i], b.x + j0, b.y + j0, n, manhattan, dist);
+			for (j = 0; j < n; j++) {
+				kll_update(&sk, dist[j]);
+			}
+		}
+	}
+	d = kll_quantile(&sk, 0.5);
+	kll_free(&sk);
+	free(dist);
 	
-	// We are now looping through all the features to extract the coordinates
-	// and associate them with the different groups.
-	i = 0;
-	while ((feat = OGR_L_GetNextFeature(lyr)) != NULL) {
-		geom = OGR_F_GetGeometryRef(feat);
-		if (geom != NULL && wkbFlatten(OGR_G_GetGeometryType(geom)) == wkbPoint) {
-			// Find the group with the ID of this feature.
-			grpidx = find_group_with_id(grps, gid[i], ngrps);
-			if (grpidx >= 0) {
-				*grps[grpidx].xptr = OGR_G_GetX(geom, 0);
-				grps[grpidx].xptr++;
-				*grps[grpidx].yptr = OGR_G_GetY(geom, 0);
-				grps[grpidx].yptr++;
+	return d;
+}
+
+
+
+
+
+void tile_distances(double ax, double ay, double *bx, double *by, int n, 
+					int manhattan, double *dist) {
+	int j;
+	double dx, dy;
+	if (manhattan) {
+		#pragma omp simd aligned(bx, by : GD_ALIGN)
+		for (j = 0; j < n; j++) {
+			dist[j] = fabs(ax - bx[j]) + fabs(ay - by[j]);
+		}
+	} else {
+		#pragma omp simd aligned(bx, by : GD_ALIGN) private(dx, dy)
+		for (j = 0; j < n; j++) {
+			dx = ax - bx[j];
+			dy = ay - by[j];
+			dist[j] = sqrt(dx*dx + dy*dy);
+		}
+	}
+}
+
+
+
+
+
+void select_distances(group a, group b, int manhattan, size_t k, 
+					  double *dk, double *dk1) {
+	
+	int i, h, n, r;
+	size_t cnt, below, rank, *hcount;
+	double lo, hi, above, next, mx, my;
+	double axmin, axmax, aymin, aymax, bxmin, bxmax, bymin, bymax;
+	double *hmin, *hmax, *buf, *dist;
+	
+	cnt = (size_t)a.npts * (size_t)b.npts;
+	hcount = malloc(GD_BUCKETS * sizeof(size_t));
+	hmin = malloc(GD_BUCKETS * sizeof(double));
+	hmax = malloc(GD_BUCKETS * sizeof(double));
+	buf = malloc(MIN(cnt, GD_CHUNK) * sizeof(double));
+	dist = malloc(GD_TILE * sizeof(double));
+	if (hcount == NULL || hmin == NULL || hmax == NULL || buf == NULL || dist == NULL) {
+		fprintf(stderr, "Error. Not enough memory available.\n");
+		exit(1);
+	}
+	
+	// If all the distances fit into memory, select them directly.
+	if (cnt <= GD_CHUNK) {
+		n = collect_distances(a, b, manhattan, 0.0, INFINITY, buf, dist);
+		r = (int)k;
+		select_kth(buf, n, r);
+		*dk = buf[r];
+		*dk1 = INFINITY;
+		for (i = r + 1; i < n; i++) {
+			*dk1 = (buf[i] < *dk1) ? buf[i] : *dk1;
+		}
+	} else {
+		// Upper bound of the distances from the bounding boxes of the groups,
+		// with a small margin for rounding errors.
+		axmin = axmax = a.x[0]; aymin = aymax = a.y[0];
+		for (i = 1; i < a.npts; i++) {
+			axmin = MIN(axmin, a.x[i]); axmax = (a.x[i] > axmax) ? a.x[i] : axmax;
+			aymin = MIN(aymin, a.y[i]); aymax = (a.y[i] > aymax) ? a.y[i] : aymax;
+		}
+		bxmin = bxmax = b.x[0]; bymin = bymax = b.y[0];
+		for (i = 1; i < b.npts; i++) {
+			bxmin = MIN(bxmin, b.x[i]); bxmax = (b.x[i] > bxmax) ? b.x[i] : bxmax;
+			bymin = MIN(bymin, b.y[i]); bymax = (b.y[i] > bymax) ? b.y[i] : bymax;
+		}
+		mx = (axmax - bxmin > bxmax - axmin) ? axmax - bxmin : bxmax - axmin;
+		my = (aymax - bymin > bymax - aymin) ? aymax - bymin : bymax - aymin;
+		hi = manhattan ? mx + my : sqrt(mx*mx + my*my);
+		hi = hi * (1.0 + 1e-9) + 1e-300;
+		lo = 0.0;
+		
+		// Narrow down the range [lo, hi] to the bucket containing rank k,
+		// until the bucket fits into memory. The bucket index is a monotonic
+		// function of the distance, so the next range [hmin, hmax] contains
+		// exactly the distances of the bucket.
+		while (1) {
+			histogram_distances(a, b, manhattan, lo, hi, hcount, hmin, hmax, 
+								&below, &above, dist);
+			rank = k - below;
+			for (h = 0; rank >= hcount[h]; h++) {
+				rank -= hcount[h];
+			}
+			
+			// Smallest distance after the bucket.
+			next = above;
+			for (i = h + 1; i < GD_BUCKETS; i++) {
+				if (hcount[i] > 0) {
+					next = hmin[i];
+					break;
+				}
 			}
+			
+			if (hmin[h] == hmax[h]) {
+				*dk = hmin[h];
+				*dk1 = (rank + 1 < hcount[h]) ? hmin[h] : next;
+				break;
+			}
+			if (hcount[h] <= GD_CHUNK) {
+				n = collect_distances(a, b, manhattan, hmin[h], hmax[h], buf, dist);
+				r = (int)rank;
+				select_kth(buf, n, r);
+				*dk = buf[r];
+				*dk1 = next;
+				for (i = r + 1; i < n; i++) {
+					*dk1 = (buf[i] < *dk1) ? buf[i] : *dk1;
+				}
+				break;
+			}
+			lo = hmin[h];
+			hi = hmax[h];
 		}
-		OGR_F_Destroy(feat);
-		i++;
 	}
-	OGR_L_ResetReading(lyr);
 	
+	free(hcount);
+	free(hmin);
+	free(hmax);
+	free(buf);
+	free(dist);
+}
+
+
+
+
+
+void histogram_distances(group a, group b, int manhattan, double lo, double hi,
+						 size_t *hcount, double *hmin, double *hmax,
+						 size_t *below, double *above, double *dist) {
 	
-	// The structure is now in place and we can start computing the distances.
+	int i, j0, j, n, h;
+	double d, scale;
 	
-	// We don't need the group id's anymore, and we can close the OGR datasource.
-	free(gid);
-	OGR_DS_Destroy(ds);
+	for (h = 0; h < GD_BUCKETS; h++) {
+		hcount[h] = 0;
+		hmin[h] = INFINITY;
+		hmax[h] = -INFINITY;
+	}
+	*below = 0;
+	*above = INFINITY;
+	scale = (double)GD_BUCKETS / (hi - lo);
+	
+	for (j0 = 0; j0 < b.npts; j0 += GD_TILE) {
+		n = MIN(GD_TILE, b.npts - j0);
+		for (i = 0; i < a.npts; i++) {
+			tile_distances(a.x[i], a.y[i], b.x + j0, b.y + j0, n, manhattan, dist);
+			for (j = 0; j < n; j++) {
+				d = dist[j];
+				if (d < lo) {
+					(*below)++;
+				} else if (d > hi) {
+					*above = (d < *above) ? d : *above;
+				} else {
+					h = (int)((d - lo) * scale);
+					h = MIN(h, GD_BUCKETS - 1);
+					hcount[h]++;
+					hmin[h] = (d < hmin[h]) ? d : hmin[h];
+					hmax[h] = (d > hmax[h]) ? d : hmax[h];
+				}
+			}
+		}
+	}
+}
+
+
+
+
+
+int collect_distances(group a, group b, int manhattan, double lo, double hi,
+					  double *buf, double *dist) {
 	
-	// Print a header line to standard output
-	fprintf(stdout, "from_id\tto_id\tpt_distance\n");
+	int i, j0, j, n, cnt;
 	
-	// Number of threads = number of processors (or cores)
-	#if defined (_OPENMP)
-	omp_set_num_threads(omp_get_num_procs());
-	#endif
-	#pragma omp parallel for default(shared) private(i, j)
-	for (i = 0; i < ngrps; i++) {
-		for (j = 0; j < ngrps; j++) {
-			compute_group_distance(grps[i], grps[j], median, manhattan);
+	cnt = 0;
+	for (j0 = 0; j0 < b.npts; j0 += GD_TILE) {
+		n = MIN(GD_TILE, b.npts - j0);
+		for (i = 0; i < a.npts; i++) {
+			tile_distances(a.x[i], a.y[i], b.x + j0, b.y + j0, n, manhattan, dist);
+			for (j = 0; j < n; j++) {
+				if (dist[j] >= lo && dist[j] <= hi) {
+					buf[cnt] = dist[j];
+					cnt++;
+				}
+			}
 		}
 	}
+	return cnt;
+}
+
+
+
+
+
+void select_kth(double *v, int n, int k) {
+	select_kth_pair(v, NULL, 0, n - 1, k);
+}
+
+
+
+
+
+void kll_init(kll_sketch *s, int k, unsigned int seed) {
+	int h;
+	s->k = k;
+	s->nlevels = 1;
+	for (h = 0; h < GD_KLL_LEVELS; h++) {
+		s->size[h] = 0;
+		s->alloc[h] = 0;
+		s->items[h] = NULL;
+	}
+	s->cap[0] = k;
+	s->rnd = (seed != 0) ? seed : 1;
+}
+
+
+void kll_update(kll_sketch *s, double v) {
+	int h;
+	if (s->size[0] == s->alloc[0]) {
+		s->alloc[0] = s->k + 1;
+		s->items[0] = realloc(s->items[0], s->alloc[0] * sizeof(double));
+		if (s->items[0] == NULL) {
+			fprintf(stderr, "Error. Not enough memory available.\n");
+			exit(1);
+		}
+	}
+	s->items[0][s->size[0]] = v;
+	s->size[0]++;
+	for (h = 0; h < s->nlevels; h++) {
+		if (s->size[h] >= s->cap[h]) {
+			kll_compact(s, h);
+		}
+	}
+}
+
+
+void kll_compact(kll_sketch *s, int h) {
 	
+	int i, n, m, offset;
+	double *up;
 	
-	// Free the ressources for the group points.
-	for (i = 0; i < ngrps; i++) {
-		free_group(grps[i]);
+	// Add a new level on top and update the capacities of all levels.
+	if (h + 1 == s->nlevels) {
+		if (s->nlevels == GD_KLL_LEVELS) {
+			fprintf(stderr, "Error. Too many values for the quantile sketch.\n");
+			exit(1);
+		}
+		s->nlevels++;
+		for (i = 0; i < s->nlevels; i++) {
+			s->cap[i] = (int)ceil(s->k * pow(GD_KLL_DECAY, s->nlevels - 1 - i));
+			s->cap[i] = (s->cap[i] < 2) ? 2 : s->cap[i];
+		}
 	}
 	
+	// Promote every other item (starting randomly at the first or second)
+	// of the sorted level. With an odd number of items, the largest stays.
+	n = s->size[h];
+	m = n - n % 2;
+	if (s->size[h+1] + m / 2 > s->alloc[h+1]) {
+		s->alloc[h+1] = 2 * (s->size[h+1] + m / 2);
+		s->items[h+1] = realloc(s->items[h+1], s->alloc[h+1] * sizeof(double));
+	}
+	if (s->items[h+1] == NULL) {
+		fprintf(stderr, "Error. Not enough memory available.\n");
+		exit(1);
+	}
+	qsort(s->items[h], n, sizeof(double), comp_dbl);
+	s->rnd ^= s->rnd << 13;
+	s->rnd ^= s->rnd >> 17;
+	s->rnd ^= s->rnd << 5;
+	offset = s->rnd & 1;
+	up = s->items[h+1] + s->size[h+1];
+	for (i = 0; i < m; i += 2) {
+		*up = s->items[h][i + offset];
+		up++;
+	}
+	s->size[h+1] += m / 2;
+	s->items[h][0] = s->items[h][n-1];
+	s->size[h] = n - m;
+}
+
+
+double kll_quantile(kll_sketch *s, double q) {
+	
+	int h, i, n;
+	double total, cum, v;
+	weighted_item *wi;
 	
-	return 0;
+	n = 0;
+	for (h = 0; h < s->nlevels; h++) {
+		n += s->size[h];
+	}
+	wi = malloc(n * sizeof(weighted_item));
+	if (wi == NULL) {
+		fprintf(stderr, "Error. Not enough memory available.\n");
+		exit(1);
+	}
+	n = 0;
+	total = 0.0;
+	for (h = 0; h < s->nlevels; h++) {
+		for (i = 0; i < s->size[h]; i++) {
+			wi[n].v = s->items[h][i];
+			wi[n].w = ldexp(1.0, h);
+			total += wi[n].w;
+			n++;
+		}
+	}
+	qsort(wi, n, sizeof(weighted_item), comp_weighted);
+	
+	cum = 0.0;
+	v = wi[n-1].v;
+	for (i = 0; i < n; i++) {
+		cum += wi[i].w;
+		if (cum > q * total) {
+			v = wi[i].v;
+			break;
+		}
+	}
+	free(wi);
+	return v;
+}
+
+
+void kll_free(kll_sketch *s) {
+	int h;
+	for (h = 0; h < GD_KLL_LEVELS; h++) {
+		free(s->items[h]);
+		s->items[h] = NULL;
+	}
 }
 
 
 
 
 
-void compute_group_distance(group a, group b, int median, int manhattan) {
+double nn_distance(group a, group b, int metric, int manhattan) {
 	
-	int i, j, cnt;
-	double *dist, *dist_ptr;
-	double d;
+	int i;
+	double d, dmin, sum, hmax;
+	group t;
 	
-	cnt = 0;
+	if (a.x == b.x) {
+		return 0.0;
+	}
 	
-	if (median) {
-		
-		// Allocate the memory for storing all the distances.
-		dist = calloc(a.npts * b.npts, sizeof(double));
-		dist_ptr = dist;
-		
-		if (manhattan) {
+	switch (metric) {
+		case GD_MIN:
+			// Query the tree of the larger group. The current minimum
+			// bounds the search.
+			if (a.npts > b.npts) {
+				t = a; a = b; b = t;
+			}
+			dmin = INFINITY;
+			for (i = 0; i < a.npts && dmin > 0.0; i++) {
+				dmin = kd_nearest(b, a.x[i], a.y[i], manhattan, dmin);
+			}
+			return dmin;
+			
+		case GD_AVGNN:
+			sum = 0.0;
 			for (i = 0; i < a.npts; i++) {
-				for (j = 0; j < b.npts; j++) {
-					*dist_ptr = fabs(a.x[i] - b.x[j]) + fabs(a.y[i] - b.y[j]);
-					dist_ptr++;
-					cnt++;
-				}
+				sum += kd_nearest(b, a.x[i], a.y[i], manhattan, INFINITY);
 			}
-		} else {
+			for (i = 0; i < b.npts; i++) {
+				sum += kd_nearest(a, b.x[i], b.y[i], manhattan, INFINITY);
+			}
+			return sum / (double)(a.npts + b.npts);
+			
+		case GD_HAUSDORFF:
+			// A point with a neighbour closer than the current maximum
+			// cannot change it, so the search is bounded by the maximum
+			// and completed only for the other points.
+			hmax = 0.0;
 			for (i = 0; i < a.npts; i++) {
-				for (j = 0; j < b.npts; j++) {
-					*dist_ptr = sqrt( pow(a.x[i] - b.x[j], 2) + pow(a.y[i] - b.y[j], 2) );
-					dist_ptr++;
-					cnt++;
+				if (kd_nearest(b, a.x[i], a.y[i], manhattan, hmax) >= hmax) {
+					d = kd_nearest(b, a.x[i], a.y[i], manhattan, INFINITY);
+					hmax = (d > hmax) ? d : hmax;
+				}
+			}
+			for (i = 0; i < b.npts; i++) {
+				if (kd_nearest(a, b.x[i], b.y[i], manhattan, hmax) >= hmax) {
+					d = kd_nearest(a, b.x[i], b.y[i], manhattan, INFINITY);
+					hmax = (d > hmax) ? d : hmax;
 				}
 			}
+			return hmax;
+	}
+	
+	return 0.0;
+}
+
+
+
+
+
+void kd_build(double *x, double *y, int lo, int hi, int depth) {
+	int mid;
+	if (hi - lo <= GD_KD_LEAF) {
+		return;
+	}
+	mid = (lo + hi) / 2;
+	if (depth % 2 == 0) {
+		select_kth_pair(x, y, lo, hi - 1, mid);
+	} else {
+		select_kth_pair(y, x, lo, hi - 1, mid);
+	}
+	kd_build(x, y, lo, mid, depth + 1);
+	kd_build(x, y, mid + 1, hi, depth + 1);
+}
+
+
+double kd_nearest(group g, double qx, double qy, int manhattan, double best) {
+	return kd_search(g.x, g.y, 0, g.npts, 0, qx, qy, manhattan, best);
+}
+
+
+double kd_search(double *x, double *y, int lo, int hi, int depth, 
+				 double qx, double qy, int manhattan, double best) {
+	
+	int i, mid;
+	double d, dx, dy, diff;
+	
+	// Leaves are searched linearly.
+	if (hi - lo <= GD_KD_LEAF) {
+		for (i = lo; i < hi; i++) {
+			dx = qx - x[i];
+			dy = qy - y[i];
+			d = manhattan ? fabs(dx) + fabs(dy) : sqrt(dx*dx + dy*dy);
+			best = (d < best) ? d : best;
 		}
-		
-		qsort(dist, a.npts * b.npts, sizeof(double), comp_dbl);
-		if (cnt % 2 == 0) {
-			d = (dist[cnt/2] + dist[(cnt/2)-1]) / 2.0f;
-		} else {
-			d = dist[(cnt-1)/2];
+		return best;
+	}
+	
+	mid = (lo + hi) / 2;
+	dx = qx - x[mid];
+	dy = qy - y[mid];
+	d = manhattan ? fabs(dx) + fabs(dy) : sqrt(dx*dx + dy*dy);
+	best = (d < best) ? d : best;
+	
+	// Visit first the side of the query point. The distance to the
+	// splitting line is a lower bound for the other side, with both metrics.
+	diff = (depth % 2 == 0) ? dx : dy;
+	if (diff < 0) {
+		best = kd_search(x, y, lo, mid, depth + 1, qx, qy, manhattan, best);
+		if (-diff < best) {
+			best = kd_search(x, y, mid + 1, hi, depth + 1, qx, qy, manhattan, best);
 		}
-		
-		free(dist);
-		
 	} else {
+		best = kd_search(x, y, mid + 1, hi, depth + 1, qx, qy, manhattan, best);
+		if (diff < best) {
+			best = kd_search(x, y, lo, mid, depth + 1, qx, qy, manhattan, best);
+		}
+	}
+	return best;
+}
+
+
+void select_kth_pair(double *v, double *other, int lo, int hi, int k) {
+	
+	int i, j;
+	double pivot, t;
+	
+	while (lo < hi) {
+		// Median of three as pivot.
+		pivot = v[(lo + hi) / 2];
+		if ((v[lo] < pivot) != (v[lo] < v[hi])) {
+			pivot = v[lo];
+		} else if ((v[hi] < pivot) != (v[hi] < v[lo])) {
+			pivot = v[hi];
+		}
 		
-		d = 0.0f;
-		
-		if (manhattan) {
-			for (i = 0; i < a.npts; i++) {
-				for (j = 0; j < b.npts; j++) {
-					d += fabs(a.x[i] - b.x[j]) + fabs(a.y[i] - b.y[j]);
-					cnt++;
+		// Hoare partition.
+		i = lo;
+		j = hi;
+		while (i <= j) {
+			while (v[i] < pivot) i++;
+			while (v[j] > pivot) j--;
+			if (i <= j) {
+				t = v[i]; v[i] = v[j]; v[j] = t;
+				if (other != NULL) {
+					t = other[i]; other[i] = other[j]; other[j] = t;
 				}
+				i++;
+				j--;
 			}
+		}
+		
+		if (k <= j) {
+			hi = j;
+		} else if (k >= i) {
+			lo = i;
 		} else {
-			for (i = 0; i < a.npts; i++) {
-				for (j = 0; j < b.npts; j++) {
-					d += sqrt( pow(a.x[i] - b.x[j], 2) + pow(a.y[i] - b.y[j], 2) );
-					cnt++;
-				}
-			}
+			return;
 		}
-		d /= (double)cnt;
 	}
-	
-	fprintf(stdout, "%d\t%d\t%f\n", a.gid, b.gid, d);
 }
 
 
 
 
 
-group make_group(int npts, int gid) {
+group make_group(int cap, int gid) {
 	group g;
-	g.npts = npts;
+	g.npts = 0;
+	g.cap = cap;
 	g.gid = gid;
-	g.x = calloc(npts, sizeof(double));
-	g.y = calloc(npts, sizeof(double));
-	g.xptr = g.x;
-	g.yptr = g.y;
+	g.x = aligned_realloc(NULL, 0, cap);
+	g.y = aligned_realloc(NULL, 0, cap);
+	g.sx = g.sy = g.psx = g.psy = NULL;
 	return g;
 }
 
 
+void add_point(group *g, double x, double y) {
+	if (g->npts == g->cap) {
+		g->x = aligned_realloc(g->x, g->npts, 2 * g->cap);
+		g->y = aligned_realloc(g->y, g->npts, 2 * g->cap);
+		g->cap *= 2;
+	}
+	g->x[g->npts] = x;
+	g->y[g->npts] = y;
+	g->npts++;
+}
+
+
+double *aligned_realloc(double *p, int n, int newn) {
+	double *q;
+	if (posix_memalign((void**)&q, GD_ALIGN, newn * sizeof(double)) != 0) {
+		fprintf(stderr, "Error. Not enough memory available.\n");
+		exit(1);
+	}
+	if (p != NULL) {
+		memcpy(q, p, n * sizeof(double));
+		free(p);
+	}
+	return q;
+}
+
+
 void free_group(group g) {
 	free(g.x);
 	free(g.y);
+	free(g.sx);
+	free(g.sy);
+	free(g.psx);
+	free(g.psy);
 }
 
 
-int find_group_with_id(group *grps, int gid, int ngrps) {
+
+
+
+void table_init(group_table *t, int size) {
 	int i;
-	group g;
-	for (i = 0; i < ngrps; i++) {
-		g = grps[i];
-		if (g.gid == gid) {
-			return i;
+	t->size = 16;
+	while (t->size < size) {
+		t->size *= 2;
+	}
+	t->count = 0;
+	t->keys = malloc(t->size * sizeof(int));
+	t->values = malloc(t->size * sizeof(int));
+	if (t->keys == NULL || t->values == NULL) {
+		fprintf(stderr, "Error. Not enough memory available.\n");
+		exit(1);
+	}
+	for (i = 0; i < t->size; i++) {
+		t->values[i] = -1;
+	}
+}
+
+
+int table_find(group_table *t, int key) {
+	unsigned int h;
+	h = TABLE_HASH(key) & (t->size - 1);
+	while (t->values[h] >= 0) {
+		if (t->keys[h] == key) {
+			return t->values[h];
 		}
+		h = (h + 1) & (t->size - 1);
 	}
 	return -1;
 }
 
 
-int comp_int_asc(const void *i, const void *j) {
-    return *(int *)i - *(int *)j;
+void table_insert(group_table *t, int key, int value) {
+	
+	int i, *keys, *values, size;
+	unsigned int h;
+	
+	// Double the size of the table when it is half full.
+	if (2 * (t->count + 1) > t->size) {
+		keys = t->keys;
+		values = t->values;
+		size = t->size;
+		table_init(t, 2 * size);
+		for (i = 0; i < size; i++) {
+			if (values[i] >= 0) {
+				table_insert(t, keys[i], values[i]);
+			}
+		}
+		free(keys);
+		free(values);
+	}
+	
+	h = TABLE_HASH(key) & (t->size - 1);
+	while (t->values[h] >= 0) {
+		h = (h + 1) & (t->size - 1);
+	}
+	t->keys[h] = key;
+	t->values[h] = value;
+	t->count++;
+}
+
+
+void table_free(group_table *t) {
+	free(t->keys);
+	free(t->values);
+}
+
+
+
+
+
+int comp_group_id(const void *i, const void *j) {
+	int a = ((group*)i)->gid;
+	int b = ((group*)j)->gid;
+	return (a > b) - (a < b);
 }
 
 int comp_dbl(const void *i, const void *j) {
@@ -297,3 +1194,7 @@ int comp_dbl(const void *i, const void *j) {
 	return (a > b) - (a < b);
 }
 
+int comp_weighted(const void *i, const void *j) {
+	return comp_dbl(&((weighted_item*)i)->v, &((weighted_item*)j)->v);
+}
+
@@ -9,49 +9,387 @@
 
 
 
+#include <stdio.h>
+
+
+
+/*
+ * Alignment (in bytes) of the coordinate arrays of the groups, and number
+ * of points of a group processed in one tile by the distance kernels.
+ * A tile of x and y coordinates (2 x 8 kB) stays in the L1 cache while it
+ * is compared to all the points of the other group.
+ */
+#define GD_ALIGN 64
+#define GD_TILE 512
+
+
+/*
+ * Group distance metrics.
+ * GD_MEAN			mean distance between all the pairs of points
+ * GD_MEDIAN		median distance between all the pairs of points
+ * GD_MIN			minimum distance between two points of the groups
+ * GD_AVGNN			average distance from each point of both groups to
+ *					its nearest neighbour in the other group
+ * GD_HAUSDORFF		Hausdorff distance, i.e. largest distance from a point
+ *					of one group to its nearest neighbour in the other group
+ */
+#define GD_MEAN 0
+#define GD_MEDIAN 1
+#define GD_MIN 2
+#define GD_AVGNN 3
+#define GD_HAUSDORFF 4
+
+
 /*
- * Structure for storing the points of a group.
+ * Output types.
+ * GD_OUT_TEXT		tab-separated text with one line per ordered pair of groups
+ * GD_OUT_MATRIX	full matrix of float64 values, row by row
+ * GD_OUT_TRIANGLE	upper triangle of the matrix (with the diagonal) of
+ *					float64 values, row by row
+ * GD_OUT_RASTER	GDAL raster with one float64 band
+ */
+#define GD_OUT_TEXT 0
+#define GD_OUT_MATRIX 1
+#define GD_OUT_TRIANGLE 2
+#define GD_OUT_RASTER 3
+
+
+/*
+ * Size of the stdio buffer for the text output.
+ */
+#define GD_OUT_BUFFER (1 << 20)
+
+
+/*
+ * Number of values in the upper triangle of an n x n matrix including the
+ * diagonal, and index of the value at row i and column j >= i.
+ */
+#define GD_TRI_SIZE(n) ((size_t)(n) * ((size_t)(n) + 1) / 2)
+#define GD_TRI_IDX(i, j, n) \
+	((size_t)(i) * (2 * (size_t)(n) - (size_t)(i) + 1) / 2 + (size_t)((j) - (i)))
+
+
+/*
+ * Number of points below which a k-d tree node is searched linearly.
+ */
+#define GD_KD_LEAF 8
+
+
+/*
+ * Exact median: maximum number of distances held in memory for one pair of
+ * groups, and number of histogram buckets used for narrowing down the range
+ * of distances containing the median when there are more distances.
+ */
+#define GD_CHUNK (1 << 20)
+#define GD_BUCKETS 4096
+
+
+/*
+ * Approximate median: maximum number of levels of the KLL sketch, and ratio
+ * between the capacities of two consecutive levels.
+ */
+#define GD_KLL_LEVELS 64
+#define GD_KLL_DECAY (2.0 / 3.0)
+
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+
+
+/*
+ * Structure for storing the points of a group. The coordinates are stored
+ * as two separate arrays (structure of arrays) aligned on GD_ALIGN bytes.
  */
 typedef struct {
 	int gid;		// Group id
 	int npts;		// Number of points in the group
+	int cap;		// Allocated size of the coordinate arrays
 	double *x;		// Array of x coordinates
 	double *y;		// Array of y coordinates
-	double *xptr;	// A pointer to the x array
-	double *yptr;	// A pointer to the y array
+	double *sx;		// Sorted x coordinates (mean Manhattan distance only)
+	double *sy;		// Sorted y coordinates (mean Manhattan distance only)
+	double *psx;	// Prefix sums of sx (npts+1 values, starting with 0)
+	double *psy;	// Prefix sums of sy (npts+1 values, starting with 0)
 } group;
 
 
 
 /*
- * Function for computing the group distances.
+ * Initial allocated number of points of a group.
  */
-int group_dist(char *infile, char *layer, char *group_attr, int median, int manhattan);
+#define GD_GROUP_SIZE 16
 
 
 
 /*
- * Computes the group distance between two groups.
+ * Hash table from group IDs to the index of the group, with open
+ * addressing and linear probing. Empty slots have a value of -1.
  */
-void compute_group_distance(group a, group b, int median, int manhattan);
+typedef struct {
+	int size;		// Number of slots, a power of 2
+	int count;		// Number of used slots
+	int *keys;		// Group IDs
+	int *values;	// Group indices
+} group_table;
 
 
+/*
+ * Multiplicative hash of a group ID (Knuth), with the high bits
+ * mixed into the low bits used for the slot index.
+ */
+#define TABLE_HASH(key) \
+	(((unsigned int)(key) * 2654435761u) ^ (((unsigned int)(key) * 2654435761u) >> 16))
+
+
+
+/*
+ * KLL quantile sketch (Karnin, Lang & Liberty, 2016). Level h holds items
+ * with a weight of 2^h. When a level is full, it is sorted and every other
+ * item is promoted to the next level. The memory used is O(k log(n/k)) and
+ * the rank error O(1/k) for n items.
+ */
+typedef struct {
+	int k;							// Capacity of the top level
+	int nlevels;					// Number of levels in use
+	int size[GD_KLL_LEVELS];		// Number of items in each level
+	int alloc[GD_KLL_LEVELS];		// Allocated size of each level
+	int cap[GD_KLL_LEVELS];			// Capacity of each level
+	double *items[GD_KLL_LEVELS];	// Items of each level
+	unsigned int rnd;				// State of the random number generator
+} kll_sketch;
+
+
+/*
+ * Item of a KLL sketch with its weight, used for quantile queries.
+ */
+typedef struct {
+	double v;
+	double w;
+} weighted_item;
+
+
+
+/*
+ * Function for computing the group distances. The distances are written to
+ * outfile (or to standard output for text output with outfile NULL) in the
+ * given output type. For the binary types, the group IDs are written in
+ * the order of the rows to outfile.ids.
+ */
+int group_dist(char *infile, char *layer, char *group_attr, int metric, int manhattan, 
+			   double median_error, char *outfile, int output_type, char *format);
+
+
+
+/*
+ * Writers for the different output types. dist is the upper triangle of
+ * the distance matrix.
+ */
+void write_text(char *outfile, group *grps, double *dist, int ngrps);
+void write_matrix(char *outfile, double *dist, int ngrps);
+void write_triangle(char *outfile, double *dist, int ngrps);
+void write_raster(char *outfile, char *format, double *dist, int ngrps);
+void write_group_ids(char *outfile, group *grps, int ngrps);
+
+
+/*
+ * Copies the full row i of the distance matrix into row.
+ */
+void matrix_row(double *dist, int ngrps, int i, double *row);
+
+
+
+/*
+ * Computes the group distance between two groups. The distance is
+ * symmetric, i.e. the distance from a to b is the same as from b to a.
+ */
+double compute_group_distance(group a, group b, int metric, int manhattan, 
+							  double median_error);
+
+
+
+/*
+ * Mean Euclidean or Manhattan distance between all the points of
+ * two groups.
+ */
+double mean_distance(group a, group b, int manhattan);
+
+
+
+/*
+ * Mean Manhattan distance between two groups with sorted coordinates.
+ * The sum of |xa - xb| over all pairs of points is computed by merging the
+ * sorted x coordinates of both groups; with the prefix sums of b, the
+ * contribution of each point of a is known from the number of points
+ * of b on its left. Same for y. The cost is O(na + nb) per pair of groups.
+ */
+double mean_manhattan_sorted(group a, group b);
+
+
+
+/*
+ * Sum of |va[i] - vb[j]| over all i and j, for sorted arrays va and vb.
+ * pb contains the nb+1 prefix sums of vb.
+ */
+double sum_abs_diff(double *va, int na, double *vb, double *pb, int nb);
+
+
+
+/*
+ * Sorts the coordinates of a group and computes their prefix sums, for
+ * mean_manhattan_sorted. The coordinates are shifted by (cx, cy) for
+ * keeping the prefix sums small.
+ */
+void sort_group(group *g, double cx, double cy);
+
+
+
+/*
+ * Median Euclidean or Manhattan distance between all the points of two
+ * groups. If median_error is 0, the exact median is computed by narrowing
+ * down the range of distances with histograms until it contains at most
+ * GD_CHUNK distances, and selecting the median among them. Otherwise, the
+ * median is approximated with a KLL sketch with a rank error of about
+ * median_error times the number of point pairs.
+ */
+double median_distance(group a, group b, int manhattan, double median_error);
+
+
+
+/*
+ * Computes the distances from the point (ax, ay) to the n points in bx, by.
+ */
+void tile_distances(double ax, double ay, double *bx, double *by, int n, 
+					int manhattan, double *dist);
+
+
+
+/*
+ * Finds the distances with rank k and k+1 (starting at 0) among all the
+ * distances between the points of a and b, using at most GD_CHUNK distances
+ * in memory. The distance with rank k+1 is undefined if k is the last rank.
+ */
+void select_distances(group a, group b, int manhattan, size_t k, 
+					  double *dk, double *dk1);
+
+
+
+/*
+ * Computes a histogram of the distances between lo and hi, with the number
+ * of distances, the smallest and the largest distance in each bucket.
+ * Also counts the distances smaller than lo and finds the smallest distance
+ * larger than hi.
+ */
+void histogram_distances(group a, group b, int manhattan, double lo, double hi,
+						 size_t *hcount, double *hmin, double *hmax,
+						 size_t *below, double *above, double *dist);
+
+
+
+/*
+ * Copies all the distances between lo and hi into buf, and returns their
+ * number.
+ */
+int collect_distances(group a, group b, int manhattan, double lo, double hi,
+					  double *buf, double *dist);
+
+
+
+/*
+ * Partially sorts the array v of n values such that v[k] is the value
+ * with rank k, all values before are smaller or equal, and all values after
+ * are larger or equal (quickselect).
+ */
+void select_kth(double *v, int n, int k);
+
+
+
+void kll_init(kll_sketch *s, int k, unsigned int seed);
+void kll_update(kll_sketch *s, double v);
+void kll_compact(kll_sketch *s, int h);
+double kll_quantile(kll_sketch *s, double q);
+void kll_free(kll_sketch *s);
+
+
+
+/*
+ * Minimum, average nearest neighbour or Hausdorff distance between two
+ * groups (see GD_MIN, GD_AVGNN, GD_HAUSDORFF), using the k-d trees of
+ * the groups. The distance of a group to itself is 0.
+ */
+double nn_distance(group a, group b, int metric, int manhattan);
+
+
+
+/*
+ * Reorders the points of a group into a balanced k-d tree. The tree is
+ * implicit: the root of the points between lo and hi is the point in the
+ * middle, splitting along x at even depths and along y at odd depths.
+ */
+void kd_build(double *x, double *y, int lo, int hi, int depth);
+
+
+/*
+ * Returns the distance from (qx, qy) to the nearest point of a group
+ * organised by kd_build, if it is smaller than best. Returns best otherwise.
+ * Subtrees farther than best are not visited.
+ */
+double kd_nearest(group g, double qx, double qy, int manhattan, double best);
+double kd_search(double *x, double *y, int lo, int hi, int depth, 
+				 double qx, double qy, int manhattan, double best);
+
+
+/*
+ * Same as select_kth for the values of v between lo and hi (inclusive),
+ * moving the values of other (if not NULL) along with those of v.
+ */
+void select_kth_pair(double *v, double *other, int lo, int hi, int k);
+
+
+
+/*
+ * Creates an empty group with space for cap points.
+ */
+group make_group(int cap, int gid);
+
+
+/*
+ * Appends a point to a group, doubling the size of the coordinate arrays
+ * when they are full.
+ */
+void add_point(group *g, double x, double y);
+
+
+/*
+ * Allocates an array of newn doubles aligned on GD_ALIGN bytes, and moves
+ * the n first values of p into it. p is released.
+ */
+double *aligned_realloc(double *p, int n, int newn);
+
 
-group make_group(int npts, int gid);
 void free_group(group g);
 
+
+
+void table_init(group_table *t, int size);
+
 /*
- * Finds a group with a given id inside an array of groups.
- * Returns the index of the group, or -1 in case of no such
- * group has been found.
+ * Returns the group index for a group ID, or -1 if the ID is not
+ * in the table.
  */
-int find_group_with_id(group *grps, int gid, int ngrps);
+int table_find(group_table *t, int key);
+
+void table_insert(group_table *t, int key, int value);
+void table_free(group_table *t);
+
 
 
 /*
- * Function for sorting an array of integers in ascending order.
+ * Comparison functions for qsort.
  */
-int comp_int_asc(const void *, const void *);
+int comp_group_id(const void *i, const void *j);
 int comp_dbl(const void *i, const void *j);
+int comp_weighted(const void *i, const void *j);
 
 
@@ -13,6 +13,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 
 #include "group_dist.h"
@@ -27,12 +28,16 @@ static char *usage[] = {
 	"      each group is computed. All possible combinations between the points\n",
 	"      of two groups are considered for computing the mean distance.\n",
 	"      Currently, computation of Euclidean and Mahalanobis distances are\n",
-	"      implemented. The result is written to standard output.\n",
+	"      implemented. The result is written to standard output, or to\n",
+	"      a text, binary or raster file.\n",
 	"   SYNOPSIS\n",
 	"      v.group.distance [--help]\n",
 	"         --input INPUT_DATASOURCE [--layer INPUT_LAYER]\n",
 	"         --group_attr GROUP_ATTRIBUTE\n",
-	"         [--manhattan] [--median]\n",
+	"         [--manhattan] [--median [--median_error EPS]]\n",
+	"         [--metric mean|median|min|avgnn|hausdorff]\n",
+	"         [--output OUTPUT_FILE] [--output_type text|matrix|triangle|raster]\n",
+	"         [--format RASTER_FORMAT]\n",
 	"   DESCRIPTION\n",
 	"      The following options are available:\n",
 	"         --help         Shows this usage note.\n",
@@ -46,6 +51,41 @@ static char *usage[] = {
 	"                        Euclidean distance.\n",
 	"         --median       Computes the median distance instead of mean \n",
 	"                        distance between the points.\n",
+	"         --median_error Approximates the median distance with a quantile\n",
+	"                        sketch using a constant amount of memory.\n",
+	"                        EPS is the maximal error on the rank of the\n",
+	"                        median, as a fraction of the number of point\n",
+	"                        pairs (e.g. 0.01). By default, the exact median\n",
+	"                        is computed.\n",
+	"         --metric       The group distance to compute:\n",
+	"                        mean: mean distance between all pairs of points\n",
+	"                           of the two groups (default).\n",
+	"                        median: median distance between all pairs of\n",
+	"                           points (same as --median).\n",
+	"                        min: distance between the closest points of\n",
+	"                           the two groups.\n",
+	"                        avgnn: average distance from the points of both\n",
+	"                           groups to their nearest neighbour in the\n",
+	"                           other group.\n",
+	"                        hausdorff: Hausdorff distance, i.e. largest\n",
+	"                           distance from a point of one group to its\n",
+	"                           nearest neighbour in the other group.\n",
+	"         --output       Path to the output file. Text output is written\n",
+	"                        to standard output if no file is given.\n",
+	"         --output_type  The type of the output:\n",
+	"                        text: tab-separated text file with one line per\n",
+	"                           pair of groups, ordered by group ID (default).\n",
+	"                        matrix: binary file with the full distance matrix\n",
+	"                           as float64 values (native byte order), row by\n",
+	"                           row.\n",
+	"                        triangle: binary file with the upper triangle of\n",
+	"                           the distance matrix including the diagonal\n",
+	"                           as float64 values, row by row.\n",
+	"                        raster: GDAL raster with the distance matrix.\n",
+	"                        For the binary and raster outputs, the group IDs\n",
+	"                        of the rows are written to OUTPUT_FILE.ids.\n",
+	"         --format       The GDAL raster format for the raster output.\n",
+	"                        Default is 'GTiff'.\n",
 	"   BUGS\n",
 	"      Please send any comments or bug reports to chri.kais@gmail.com.\n",
 	"   VERSION\n",
@@ -66,8 +106,9 @@ int main (int argc, const char *argv[]) {
 	int c;
 	int ok;
 	
-	char *infile, *layer, *group_attr;
-	int manhattan, median;
+	char *infile, *layer, *group_attr, *outfile, *format;
+	int manhattan, metric, output_type;
+	double median_error;
 	
 	extern int optind;
 	extern int optopt;
@@ -81,8 +122,12 @@ int main (int argc, const char *argv[]) {
 	
 	
 	// Provide default values.
-	infile = layer = group_attr = NULL;
-	median = manhattan = 0;
+	infile = layer = group_attr = outfile = NULL;
+	format = "GTiff";
+	output_type = GD_OUT_TEXT;
+	metric = GD_MEAN;
+	manhattan = 0;
+	median_error = 0.0;
 	
 	
 	// Process command line
@@ -95,6 +140,11 @@ int main (int argc, const char *argv[]) {
 			{"group_attr",		required_argument,  0,  'g'},
 			{"median",          no_argument,		0,	'm'},
 			{"manhattan",		no_argument,		0,  't'},
+			{"median_error",	required_argument,	0,  'e'},
+			{"metric",			required_argument,	0,  'd'},
+			{"output",			required_argument,	0,  'o'},
+			{"output_type",		required_argument,	0,  'y'},
+			{"format",			required_argument,	0,  'f'},
 			{0, 0, 0, 0}
 		};
 		
@@ -117,11 +167,50 @@ int main (int argc, const char *argv[]) {
 				group_attr = optarg;
 				break;
 			case 'm':
-				median = 1;
+				metric = GD_MEDIAN;
 				break;
 			case 't':
 				manhattan = 1;
 				break;
+			case 'e':
+				median_error = atof(optarg);
+				break;
+			case 'd':
+				if (strcmp(optarg, "mean") == 0) {
+					metric = GD_MEAN;
+				} else if (strcmp(optarg, "median") == 0) {
+					metric = GD_MEDIAN;
+				} else if (strcmp(optarg, "min") == 0) {
+					metric = GD_MIN;
+				} else if (strcmp(optarg, "avgnn") == 0) {
+					metric = GD_AVGNN;
+				} else if (strcmp(optarg, "hausdorff") == 0) {
+					metric = GD_HAUSDORFF;
+				} else {
+					fprintf(stderr, "Error. Unknown metric '%s'.\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'o':
+				outfile = optarg;
+				break;
+			case 'y':
+				if (strcmp(optarg, "text") == 0) {
+					output_type = GD_OUT_TEXT;
+				} else if (strcmp(optarg, "matrix") == 0) {
+					output_type = GD_OUT_MATRIX;
+				} else if (strcmp(optarg, "triangle") == 0) {
+					output_type = GD_OUT_TRIANGLE;
+				} else if (strcmp(optarg, "raster") == 0) {
+					output_type = GD_OUT_RASTER;
+				} else {
+					fprintf(stderr, "Error. Unknown output type '%s'.\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'f':
+				format = optarg;
+				break;
 			case '?':
 				return 1;
 			default:
@@ -140,9 +229,22 @@ int main (int argc, const char *argv[]) {
 		fprintf(stderr, "Error. Specify an group attribute.\n");
 		exit(1);
 	}
+	if (median_error < 0.0 || median_error >= 1.0) {
+		fprintf(stderr, "Error. The median error must be between 0 and 1.\n");
+		exit(1);
+	}
+	if (median_error > 0.0 && metric != GD_MEDIAN) {
+		fprintf(stderr, "Error. The median error requires the --median option.\n");
+		exit(1);
+	}
+	if (output_type != GD_OUT_TEXT && outfile == NULL) {
+		fprintf(stderr, "Error. You must provide an output file for this output type.\n");
+		exit(1);
+	}
 	
 	// Let's go!
-	ok = group_dist(infile, layer, group_attr, median, manhattan);
+	ok = group_dist(infile, layer, group_attr, metric, manhattan, median_error, 
+					outfile, output_type, format);
 	
 	return ok;
 }